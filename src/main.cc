@@ -1,136 +1,277 @@
 #include "spVCF.h"
+#include "reader.h"
+#include "writer.h"
+#include "htslib/thread_pool.h"
+#include "htslib/vcf.h"
 #include <assert.h>
+#include <cctype>
+#include <condition_variable>
 #include <deque>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <getopt.h>
 #include <iomanip>
 #include <locale>
+#include <map>
 #include <mutex>
 #include <thread>
 #include <unistd.h>
 
 using namespace std;
 
-enum class CodecMode { encode, squeeze_only, decode };
+enum class CodecMode { encode, squeeze_only, decode, subset, sitestats };
+
+// Does the mode read spVCF (rather than pVCF)?
+bool reads_spvcf(CodecMode mode) {
+    return mode == CodecMode::decode || mode == CodecMode::subset || mode == CodecMode::sitestats;
+}
 
 void check_input_format(CodecMode mode, const string &first_line) {
-    if (first_line.size() >= 2 && uint8_t(first_line[0]) == 0x1F &&
-        uint8_t(first_line[1]) == 0x8B) {
-        throw runtime_error(
-            "input appears gzipped; decompress or pipe through `gzip -dc` for use with this tool");
-    }
-    const string vcf_startswith =
-        (mode == CodecMode::decode) ? "##fileformat=spVCF" : "##fileformat=VCF";
+    const string vcf_startswith = reads_spvcf(mode) ? "##fileformat=spVCF" : "##fileformat=VCF";
     if (first_line.size() < vcf_startswith.size() ||
         first_line.substr(0, vcf_startswith.size()) != vcf_startswith) {
         cerr << "[WARN] input doesn't begin with " << vcf_startswith
-             << "; this tool expects uncompressed VCF/spVCF format" << endl;
+             << "; this tool expects VCF/spVCF format" << endl;
+    }
+}
+
+// Blocking FIFO queue with bounded capacity, connecting the stages of the multithreaded encoder
+template <typename T> class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    // Wait for room to enqueue item; returns false if the queue has been closed.
+    bool Push(T item) {
+        unique_lock<mutex> lock(mu_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Wait for an item to dequeue; returns false once the queue has been closed and drained.
+    bool Pop(T &item) {
+        unique_lock<mutex> lock(mu_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        item = move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
     }
+
+    void Close() {
+        lock_guard<mutex> lock(mu_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+  private:
+    mutex mu_;
+    condition_variable not_full_, not_empty_;
+    deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+};
+
+// Is the spVCF line a checkpoint (lacking the spVCF_checkpointPOS INFO field)?
+bool is_checkpoint(const char *line) {
+    const char *p = line;
+    for (int i = 0; i < 7; i++) {
+        p = strchr(p, '\t');
+        if (!p) {
+            return false;
+        }
+        ++p;
+    }
+    return strncmp(p, "spVCF_checkpointPOS=", 20) != 0;
 }
 
-// Run encoder in a multithreaded way by buffering batches of input lines and
-// spawning a thread to work on each batch. Below, main_codec has a simpler
-// single-threaded default way to run the codec.
-spVCF::transcode_stats multithreaded_encode(CodecMode mode, uint64_t checkpoint_period,
-                                            bool squeeze, double roundDP_base, size_t thread_count,
-                                            istream &input_stream, ostream &output_stream) {
-    assert(mode != CodecMode::decode);
-
-    mutex mu;
-    // mu protects the following two variables:
-    deque<future<pair<spVCF::transcode_stats, shared_ptr<vector<string>>>>> output_batches;
-    bool input_complete = false;
-
-    // spawn "sink" task to await output blocks in order and write them to output_stream
-    future<spVCF::transcode_stats> sink = async(launch::async, [&]() {
-        spVCF::transcode_stats ans;
-        while (true) {
-            future<pair<spVCF::transcode_stats, shared_ptr<vector<string>>>> batch;
+// Run codec in a multithreaded way: the driver thread reads batches of input lines and queues
+// them for a pool of worker threads, each with its own Transcoder. A sink thread writes the
+// processed batches to output in their original order, then recycles them (including their
+// buffers) back to the driver. Below, main_codec has a simpler single-threaded default way
+// to run the codec.
+//
+// Each batch must begin with a checkpoint. When encoding, batches are cut at each chromosome
+// change and every checkpoint_period lines thereafter, exactly as the single-threaded encoder
+// places checkpoints. When decoding, they're cut at the first checkpoint after
+// checkpoint_period lines.
+spVCF::transcode_stats
+multithreaded_codec(CodecMode mode, const function<unique_ptr<spVCF::Transcoder>()> &new_codec,
+                    uint64_t checkpoint_period, size_t thread_count, spVCF::LineReader &input,
+                    spVCF::FileWriter &output) {
+    struct Batch {
+        uint64_t seqno = 0;
+        string input;                // input lines, each followed by NUL
+        vector<size_t> line_offsets; // position of each line in input
+        string output;               // encoded lines, each followed by '\n'
+    };
+    // the batches in circulation bound the memory usage
+    const size_t pool_size = thread_count + 2;
+    BoundedQueue<unique_ptr<Batch>> free_batches(pool_size), input_batches(pool_size),
+        output_batches(pool_size);
+    for (size_t i = 0; i < pool_size; i++) {
+        free_batches.Push(make_unique<Batch>());
+    }
+
+    // if any stage fails, record the first exception and close the queues to unblock the others
+    mutex error_mu;
+    exception_ptr error;
+    auto guard = [&](const function<void()> &stage) {
+        try {
+            stage();
+        } catch (...) {
             {
-                lock_guard<mutex> lock(mu);
-                if (output_batches.empty()) {
-                    if (input_complete) {
-                        break;
-                    } else {
-                        using namespace chrono_literals;
-                        this_thread::sleep_for(100us);
-                        continue;
-                    }
+                lock_guard<mutex> lock(error_mu);
+                if (!error) {
+                    error = current_exception();
                 }
-                batch = move(output_batches.front());
-                output_batches.pop_front();
             }
-            auto rslt = move(batch.get());
-            for (auto &line : *rslt.second) {
-                output_stream << line << '\n';
-                if (!output_stream.good()) {
-                    throw runtime_error("I/O error");
+            free_batches.Close();
+            input_batches.Close();
+            output_batches.Close();
+        }
+    };
+
+    // sink: write output batches in order
+    thread sink([&]() {
+        guard([&]() {
+            map<uint64_t, unique_ptr<Batch>> pending;
+            uint64_t next_seqno = 0;
+            unique_ptr<Batch> batch;
+            while (output_batches.Pop(batch)) {
+                uint64_t seqno = batch->seqno;
+                pending[seqno] = move(batch);
+                for (auto it = pending.find(next_seqno); it != pending.end();
+                     it = pending.find(++next_seqno)) {
+                    output.Write(it->second->output);
+                    free_batches.Push(move(it->second));
+                    pending.erase(it);
                 }
             }
-            ans += rslt.first;
-        }
-        return ans;
+        });
     });
 
-    // worker task to process a batch of input lines into output_batches
-    auto worker = [&](shared_ptr<vector<string>> input_batch) {
-        unique_ptr<spVCF::Transcoder> tc = spVCF::NewEncoder(
-            checkpoint_period, (mode == CodecMode::encode), squeeze, roundDP_base);
-        auto output_lines = make_shared<vector<string>>();
-        for (auto &input_line : *input_batch) {
-            output_lines->push_back(tc->ProcessLine(&input_line[0]));
-        }
-        return make_pair(tc->Stats(), output_lines);
-    };
+    // the header lines, which each worker's codec needs to see (e.g. the #CHROM line to select
+    // samples, or the FORMAT declarations for --with-missing-fields), though only the first batch
+    // includes them. The driver sets them before queueing any batch.
+    vector<string> header_lines;
 
-    // In driver thread, read batches of lines from input_stream, and spawn a worker
-    // for each batch. If the number of outstanding tasks hits thread_count, wait
-    // for some of them to drain.
-    auto input_batch = make_shared<vector<string>>();
-    size_t input_batch_size = 0;
-    string input_line;
-    if (getline(input_stream, input_line)) {
-        check_input_format(mode, input_line);
-        do {
-            if (!input_line.empty() && input_line[0] != '#') {
-                // TODO: it would be nice to cut off the batch at the end of each
-                // chromosome, to guarantee identical checkpoint positions between
-                // single- and multi-threaded encoder
-                ++input_batch_size;
+    // workers: encode input batches
+    vector<spVCF::transcode_stats> worker_stats(thread_count);
+    vector<thread> workers;
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back([&, i]() {
+            guard([&]() {
+                unique_ptr<spVCF::Transcoder> tc = new_codec();
+                unique_ptr<Batch> batch;
+                bool seen_header = false;
+                while (input_batches.Pop(batch)) {
+                    if (!seen_header) {
+                        seen_header = true;
+                        if (batch->seqno) {
+                            for (string header : header_lines) {
+                                tc->ProcessLine(&header[0]);
+                            }
+                        }
+                    }
+                    tc->Restart();
+                    batch->output.clear();
+                    for (size_t offset : batch->line_offsets) {
+                        const char *line = tc->ProcessLine(&batch->input[offset]);
+                        batch->output.append(line, tc->OutputLength());
+                        batch->output += '\n';
+                    }
+                    if (!output_batches.Push(move(batch))) {
+                        break;
+                    }
+                }
+                worker_stats[i] = tc->Stats();
+            });
+        });
+    }
+
+    // driver: read input lines into batches
+    guard([&]() {
+        uint64_t seqno = 0;
+        auto next_batch = [&]() {
+            unique_ptr<Batch> batch;
+            if (free_batches.Pop(batch)) {
+                batch->seqno = seqno++;
+                batch->input.clear();
+                batch->line_offsets.clear();
+            }
+            return batch;
+        };
+        unique_ptr<Batch> batch = next_batch();
+        bool first_line = true;
+        string batch_chrom;
+        uint64_t batch_data_lines = 0;
+        char *line;
+        size_t len;
+        while (batch && (line = input.NextLine(len))) {
+            if (first_line) {
+                check_input_format(mode, string(line, len));
+                first_line = false;
             }
-            size_t reserve = input_line.size() * 5 / 4;
-            input_batch->push_back(move(input_line));
-            input_line.reserve(reserve);
-            assert(input_line.empty());
-            if (input_batch_size >= checkpoint_period) {
-                while (true) {
-                    lock_guard<mutex> lock(mu);
-                    if (output_batches.size() >= thread_count) {
-                        using namespace chrono_literals;
-                        this_thread::sleep_for(100us);
-                        continue;
+            if (len && line[0] != '#') {
+                const char *tab = (const char *)memchr(line, '\t', len);
+                const size_t chrom_len = tab ? tab - line : len;
+                bool cut;
+                if (reads_spvcf(mode)) {
+                    cut = batch_data_lines >= checkpoint_period && is_checkpoint(line);
+                } else {
+                    cut = batch_chrom.compare(0, string::npos, line, chrom_len) != 0 ||
+                          (checkpoint_period > 0 && batch_data_lines >= checkpoint_period);
+                }
+                if (batch_data_lines && cut) {
+                    // this line begins a new batch
+                    if (!input_batches.Push(move(batch))) {
+                        break;
                     }
-                    output_batches.push_back(async(launch::async, worker, input_batch));
-                    break;
+                    batch = next_batch();
+                    if (!batch) {
+                        break;
+                    }
+                    batch_data_lines = 0;
+                }
+                if (!batch_data_lines) {
+                    batch_chrom.assign(line, chrom_len);
                 }
-                input_batch = make_shared<vector<string>>();
-                input_batch_size = 0;
+                ++batch_data_lines;
+            } else if (!batch->seqno) {
+                header_lines.emplace_back(line, len);
             }
-        } while (getline(input_stream, input_line));
-    }
-    {
-        lock_guard<mutex> lock(mu);
-        if (!input_batch->empty()) {
-            output_batches.push_back(async(launch::async, worker, input_batch));
+            batch->line_offsets.push_back(batch->input.size());
+            batch->input.append(line, len + 1);
+        }
+        if (batch && !batch->line_offsets.empty()) {
+            input_batches.Push(move(batch));
         }
-        input_complete = true;
+    });
+
+    input_batches.Close();
+    for (auto &worker : workers) {
+        worker.join();
     }
-    if (!input_stream.eof() || input_stream.bad()) {
-        throw runtime_error("I/O error");
+    output_batches.Close();
+    sink.join();
+    if (error) {
+        rethrow_exception(error);
     }
 
-    return sink.get();
+    spVCF::transcode_stats ans;
+    for (const auto &stats : worker_stats) {
+        ans += stats;
+    }
+    return ans;
 }
 
 void help_codec(CodecMode mode) {
@@ -141,10 +282,21 @@ void help_codec(CodecMode mode) {
             << GIT_REVISION << "    " << __TIMESTAMP__ << endl
             << endl
             << "spvcf encode [options] [in.vcf|-]" << endl
-            << "Reads VCF text from standard input if filename is empty or -" << endl
+            << "Reads VCF from standard input if filename is empty or -" << endl
+            << "Input may be uncompressed, gzip or bgzip VCF text, or BCF" << endl
             << endl
             << "Options:" << endl
             << "  -o,--output out.spvcf  Write to out.spvcf instead of standard output" << endl
+            << "  -O,--output-type u|z   Uncompressed or bgzip output (default: z if filename ends in"
+            << endl
+            << "                           .gz, otherwise u)" << endl
+            << "  -@,--bgzf-threads N    Use N threads for bgzip (de)compression" << endl
+            << "  --index                Write tabix index (.tbi) of bgzip output file" << endl
+            << "  --csi                  Write .csi index instead, for contigs >512Mbp" << endl
+            << "  --checkpoint-index     Write sidecar (.ckpt) locating checkpoints in bgzip output file,"
+            << endl
+            << "                           for faster spvcf tabix" << endl
+            << "  --align-checkpoints    Begin a new BGZF block at each checkpoint" << endl
             << "  -n,--no-squeeze        Disable lossy QC squeezing transformation (lossless run-encoding only)"
             << endl
             << "  -r,--resolution        Resolution parameter r for DP rounding, rDP=floor(r^floor(log_r(DP)))"
@@ -153,8 +305,16 @@ void help_codec(CodecMode mode) {
             << endl
             << "  -p,--period P          Ensure checkpoints (full dense rows) at this period or less (default: 1000)"
             << endl
+            << "  --checkpoint-bytes B   Also checkpoint when the output since the last checkpoint reaches"
+            << endl
+            << "                           B bytes (suffix K, M or G), to bound spvcf tabix decoding"
+            << endl
             << "  -t,--threads N         Use multithreaded encoder with this number of worker threads"
             << endl
+            << "  --column-threads N     Divide each row's columns into stripes processed by N threads"
+            << endl
+            << "                           (for very large N; uses less memory than --threads)"
+            << endl
             << "  -q,--quiet             Suppress statistics printed to standard error" << endl
             << "  -h,--help              Show this help message" << endl
             << endl;
@@ -165,16 +325,25 @@ void help_codec(CodecMode mode) {
              << endl;
         cout
             << "spvcf squeeze [options] [in.vcf|-]" << endl
-            << "Reads VCF text from standard input if filename is empty or -" << endl
+            << "Reads VCF from standard input if filename is empty or -" << endl
+            << "Input may be uncompressed, gzip or bgzip VCF text, or BCF" << endl
             << endl
             << "Options:" << endl
             << "  -o,--output out.vcf    Write to out.vcf instead of standard output" << endl
+            << "  -O,--output-type u|z   Uncompressed or bgzip output (default: z if filename ends in"
+            << endl
+            << "                           .gz, otherwise u)" << endl
+            << "  -@,--bgzf-threads N    Use N threads for bgzip (de)compression" << endl
+            << "  --index                Write tabix index (.tbi) of bgzip output file" << endl
+            << "  --csi                  Write .csi index instead, for contigs >512Mbp" << endl
             << "  -r,--resolution        Resolution parameter r for DP rounding, rDP=floor(r^floor(log_r(DP)))"
             << endl
             << "                           (default: 2.0; to increase resolution set 1.0<r<2.0)"
             << endl
             << "  -t,--threads N         Use multithreaded encoder with this many worker threads"
             << endl
+            << "  --column-threads N     Divide each row's columns into stripes processed by N threads"
+            << endl
             << "  -q,--quiet             Suppress statistics printed to standard error" << endl
             << "  -h,--help              Show this help message" << endl
             << endl;
@@ -193,25 +362,185 @@ void help_codec(CodecMode mode) {
              << endl
              << "spvcf decode [options] [in.spvcf|-]" << endl
              << "Reads spVCF text from standard input if filename is empty or -" << endl
+             << "Input may be uncompressed, gzip or bgzip" << endl
              << endl
              << "Options:" << endl
              << "  --with-missing-fields  Include trailing FORMAT fields with missing values"
              << endl
+             << "  -s,--samples FILE      Decode only the samples listed in FILE (one per line),"
+             << endl
+             << "                           keeping their order in the input" << endl
+             << "  -o,--output out.vcf    Write to out.vcf instead of standard output" << endl
+             << "  -O,--output-type u|z|b Uncompressed, bgzip or BCF output (default: z if filename ends"
+             << endl
+             << "                           in .gz, b if .bcf, otherwise u)" << endl
+             << "  -@,--bgzf-threads N    Use N threads for bgzip (de)compression" << endl
+             << "  --index                Write tabix index (.tbi) of bgzip output file" << endl
+             << "  --csi                  Write .csi index instead, for contigs >512Mbp" << endl
+             << "  -t,--threads N         Use multithreaded decoder with this number of worker threads"
+             << endl
+             << "  -q,--quiet             Suppress statistics printed to standard error" << endl
+             << "  -h,--help              Show this help message" << endl
+             << endl;
+        break;
+    case CodecMode::subset:
+        cout << "spvcf subset: subset samples of Sparse Project VCF, keeping it sparse" << endl;
+        cout << GIT_REVISION << "    " << __TIMESTAMP__ << endl
+             << endl
+             << "spvcf subset -s FILE [options] [in.spvcf|-]" << endl
+             << "Reads spVCF text from standard input if filename is empty or -" << endl
+             << "Input may be uncompressed, gzip or bgzip" << endl
+             << endl
+             << "Options:" << endl
+             << "  -s,--samples FILE      Keep the samples listed in FILE (one per line), in their"
+             << endl
+             << "                           order in the input (required)" << endl
+             << "  -o,--output out.spvcf  Write to out.spvcf instead of standard output" << endl
+             << "  -O,--output-type u|z   Uncompressed or bgzip output (default: z if filename ends in"
+             << endl
+             << "                           .gz, otherwise u)" << endl
+             << "  -@,--bgzf-threads N    Use N threads for bgzip (de)compression" << endl
+             << "  --index                Write tabix index (.tbi) of bgzip output file" << endl
+             << "  --csi                  Write .csi index instead, for contigs >512Mbp" << endl
+             << "  --checkpoint-index     Write sidecar (.ckpt) locating checkpoints in bgzip output"
+             << endl
+             << "                           file, for faster spvcf tabix" << endl
+             << "  --align-checkpoints    Begin a new BGZF block at each checkpoint" << endl
+             << "  -t,--threads N         Use this number of worker threads" << endl
+             << "  -q,--quiet             Suppress statistics printed to standard error" << endl
+             << "  -h,--help              Show this help message" << endl
+             << endl
+             << "INFO fields (such as AC and AN) are copied without recalculation." << endl
+             << endl;
+        break;
+    case CodecMode::sitestats:
+        cout << "spvcf sitestats: compute genotype statistics for each site of Sparse Project VCF"
+             << endl;
+        cout << GIT_REVISION << "    " << __TIMESTAMP__ << endl
+             << endl
+             << "spvcf sitestats [options] [in.spvcf|-]" << endl
+             << "Reads spVCF text from standard input if filename is empty or -" << endl
+             << "Input may be uncompressed, gzip or bgzip" << endl
+             << endl
+             << "Options:" << endl
              << "  -o,--output out.vcf    Write to out.vcf instead of standard output" << endl
+             << "  -O,--output-type u|z   Uncompressed or bgzip output (default: z if filename ends in"
+             << endl
+             << "                           .gz, otherwise u)" << endl
+             << "  -@,--bgzf-threads N    Use N threads for bgzip (de)compression" << endl
+             << "  --index                Write tabix index (.tbi) of bgzip output file" << endl
+             << "  --csi                  Write .csi index instead, for contigs >512Mbp" << endl
+             << "  -t,--threads N         Use this number of worker threads" << endl
              << "  -q,--quiet             Suppress statistics printed to standard error" << endl
              << "  -h,--help              Show this help message" << endl
+             << endl
+             << "Writes sites-only VCF with the INFO fields AC, AN, AF, NS (samples with called"
+             << endl
+             << "genotypes), F_MISSING (fraction of samples with missing calls), N_HET and N_HOMALT"
+             << endl
+             << "(replacing any existing fields of the same names)." << endl
              << endl;
         break;
     }
 }
 
+void print_stats(CodecMode mode, bool squeeze, const spVCF::transcode_stats &stats) {
+    cerr.imbue(locale(""));
+    cerr << "N = " << fixed << stats.N << endl;
+    cerr << "dense cells = " << fixed << stats.N * stats.lines << endl;
+    if (squeeze && mode != CodecMode::subset && mode != CodecMode::sitestats) {
+        cerr << "squeezed cells = " << fixed << stats.squeezed_cells << endl;
+    }
+    if (mode != CodecMode::squeeze_only) {
+        cerr << "sparse cells = " << fixed << stats.sparse_cells << endl;
+        cerr << "lines (non-header) = " << fixed << stats.lines << endl;
+        cerr << "lines (75% sparse) = " << fixed << stats.sparse75_lines << endl;
+        cerr << "lines (90% sparse) = " << fixed << stats.sparse90_lines << endl;
+        cerr << "lines (99% sparse) = " << fixed << stats.sparse99_lines << endl;
+    }
+    if (mode == CodecMode::encode || mode == CodecMode::subset) {
+        cerr << "checkpoints = " << fixed << stats.checkpoints << endl;
+    }
+    if (mode == CodecMode::encode && stats.checkpoints) {
+        cerr << "checkpoint interval bytes (mean) = " << fixed
+             << stats.sparse_bytes / stats.checkpoints << endl;
+        for (unsigned pct : {50, 90, 99}) {
+            cerr << "checkpoint interval bytes (" << pct << "th percentile) = " << fixed
+                 << stats.checkpoint_interval_percentile(pct) << endl;
+        }
+        cerr << "checkpoint interval bytes (max) = " << fixed
+             << stats.max_checkpoint_interval_bytes << endl;
+    }
+}
+
+// decode -O b
+int decode_bcf(spVCF::LineReader &input, const string &output_filename,
+               const vector<string> &samples, hts_tpool *pool, bool quiet) {
+    auto bcf = spVCF::NewBCFDecoder(output_filename, samples, pool);
+    size_t len;
+    char *input_line = input.NextLine(len);
+    if (input_line) {
+        check_input_format(CodecMode::decode, string(input_line, len));
+        do {
+            bcf->ProcessLine(input_line);
+        } while ((input_line = input.NextLine(len)));
+    }
+    bcf->Close();
+    if (!quiet) {
+        print_stats(CodecMode::decode, true, bcf->Stats());
+    }
+    return 0;
+}
+
+// encode (or squeeze) BCF input, handing each record to the encoder without formatting the
+// unchanged cells as text
+void encode_bcf(htsFile *input, spVCF::RowEncoder &encoder, spVCF::FileWriter &output) {
+    unique_ptr<bcf_hdr_t, void (*)(bcf_hdr_t *)> hdr(bcf_hdr_read(input), bcf_hdr_destroy);
+    if (!hdr) {
+        throw runtime_error("Failed to read BCF header");
+    }
+    kstring_t ks = {0, 0, nullptr};
+    if (bcf_hdr_format(hdr.get(), 0, &ks) != 0) {
+        free(ks.s);
+        throw runtime_error("Failed to format BCF header");
+    }
+    string header(ks.s, ks.l);
+    free(ks.s);
+    for (size_t p = 0, nl; p < header.size(); p = nl + 1) {
+        nl = header.find('\n', p);
+        if (nl == string::npos) {
+            nl = header.size();
+        }
+        header[nl] = 0;
+        const char *output_line = encoder.ProcessLine(&header[p]);
+        output.Write(output_line, encoder.OutputLength());
+        output.Write('\n');
+    }
+
+    unique_ptr<bcf1_t, void (*)(bcf1_t *)> rec(bcf_init(), bcf_destroy);
+    int ret;
+    while ((ret = bcf_read(input, hdr.get(), rec.get())) == 0) {
+        const char *output_line = encoder.ProcessBCF(hdr.get(), rec.get());
+        output.Write(output_line, encoder.OutputLength());
+        output.Write('\n');
+    }
+    if (ret < -1) {
+        throw runtime_error("Failed to read BCF record");
+    }
+}
+
 int main_codec(int argc, char *argv[], CodecMode mode) {
     bool squeeze = true;
     bool quiet = false;
     bool with_missing_fields = false;
+    vector<string> samples;
     string output_filename;
-    uint64_t checkpoint_period = 1000;
+    char output_type = 0;
+    size_t bgzf_threads = 0;
+    bool index = false, csi = false, checkpoint_index = false, align_checkpoints = false;
+    uint64_t checkpoint_period = 1000, checkpoint_bytes = 0;
     size_t thread_count = 1;
+    size_t column_threads = 1;
     double roundDP_base = 2.0;
 
     static struct option long_options[] = {{"help", no_argument, 0, 'h'},
@@ -219,13 +548,22 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
                                            {"period", required_argument, 0, 'p'},
                                            {"resolution", required_argument, 0, 'r'},
                                            {"with-missing-fields", no_argument, 0, 'm'},
+                                           {"samples", required_argument, 0, 's'},
                                            {"threads", required_argument, 0, 't'},
+                                           {"column-threads", required_argument, 0, 'c'},
                                            {"quiet", no_argument, 0, 'q'},
                                            {"output", required_argument, 0, 'o'},
+                                           {"output-type", required_argument, 0, 'O'},
+                                           {"bgzf-threads", required_argument, 0, '@'},
+                                           {"index", no_argument, 0, 'x'},
+                                           {"csi", no_argument, 0, 'C'},
+                                           {"checkpoint-index", no_argument, 0, 'k'},
+                                           {"checkpoint-bytes", required_argument, 0, 'B'},
+                                           {"align-checkpoints", no_argument, 0, 'A'},
                                            {0, 0, 0, 0}};
 
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "hnp:r:qo:t:", long_options, nullptr))) {
+    while (-1 != (c = getopt_long(argc, argv, "hnp:r:s:qo:O:t:@:", long_options, nullptr))) {
         switch (c) {
         case 'h':
             help_codec(mode);
@@ -249,8 +587,26 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
                 return -1;
             }
             break;
+        case 'B': {
+            if (mode != CodecMode::encode) {
+                help_codec(mode);
+                return -1;
+            }
+            errno = 0;
+            char *suffix = nullptr;
+            checkpoint_bytes = strtoull(optarg, &suffix, 10);
+            const char *units = "KMG", *unit = *suffix ? strchr(units, toupper(*suffix)) : nullptr;
+            const int shift = unit ? 10 * (unit - units + 1) : 0;
+            if (errno || !checkpoint_bytes || (*suffix && (!unit || suffix[1])) ||
+                checkpoint_bytes > (UINT64_MAX >> shift)) {
+                cerr << "spvcf: couldn't parse --checkpoint-bytes" << endl;
+                return -1;
+            }
+            checkpoint_bytes <<= shift;
+            break;
+        }
         case 'r':
-            if (mode == CodecMode::decode) {
+            if (reads_spvcf(mode)) {
                 help_codec(mode);
                 return -1;
             }
@@ -268,11 +624,32 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
             }
             with_missing_fields = true;
             break;
-        case 't':
-            if (mode == CodecMode::decode) {
+        case 's': {
+            if (mode != CodecMode::decode && mode != CodecMode::subset) {
                 help_codec(mode);
                 return -1;
             }
+            ifstream samples_file(optarg);
+            if (!samples_file) {
+                cerr << "spvcf: couldn't open --samples file " << optarg << endl;
+                return -1;
+            }
+            string sample;
+            while (getline(samples_file, sample)) {
+                if (!sample.empty() && sample.back() == '\r') {
+                    sample.pop_back();
+                }
+                if (!sample.empty()) {
+                    samples.push_back(sample);
+                }
+            }
+            if (samples.empty()) {
+                cerr << "spvcf: no samples listed in " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case 't':
             errno = 0;
             thread_count = strtoull(optarg, nullptr, 10);
             if (errno) {
@@ -280,6 +657,18 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
                 return -1;
             }
             break;
+        case 'c':
+            if (reads_spvcf(mode)) {
+                help_codec(mode);
+                return -1;
+            }
+            errno = 0;
+            column_threads = strtoull(optarg, nullptr, 10);
+            if (errno) {
+                cerr << "spvcf: couldn't parse --column-threads" << endl;
+                return -1;
+            }
+            break;
         case 'q':
             quiet = true;
             break;
@@ -290,6 +679,42 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
                 return -1;
             }
             break;
+        case 'O':
+            if (strlen(optarg) != 1 ||
+                !strchr(mode == CodecMode::decode ? "uzb" : "uz", optarg[0])) {
+                help_codec(mode);
+                return -1;
+            }
+            output_type = optarg[0];
+            break;
+        case 'x':
+            index = true;
+            break;
+        case 'C':
+            index = csi = true;
+            break;
+        case 'k':
+            if (mode != CodecMode::encode && mode != CodecMode::subset) {
+                help_codec(mode);
+                return -1;
+            }
+            checkpoint_index = true;
+            break;
+        case 'A':
+            if (mode != CodecMode::encode && mode != CodecMode::subset) {
+                help_codec(mode);
+                return -1;
+            }
+            align_checkpoints = true;
+            break;
+        case '@':
+            errno = 0;
+            bgzf_threads = strtoull(optarg, nullptr, 10);
+            if (errno) {
+                cerr << "spvcf: couldn't parse --bgzf-threads" << endl;
+                return -1;
+            }
+            break;
         default:
             help_codec(mode);
             return -1;
@@ -299,95 +724,140 @@ int main_codec(int argc, char *argv[], CodecMode mode) {
     string input_filename;
     if (optind == argc - 1) {
         input_filename = string(argv[optind]);
-    } else if (optind != argc) {
+    } else if (optind != argc || (mode == CodecMode::subset && samples.empty())) {
         help_codec(mode);
         return -1;
     }
 
-    // Set up input & output streams
-    std::ios_base::sync_with_stdio(false);
-    istream *input_stream = &cin;
-    cin.tie(nullptr);
-    unique_ptr<ifstream> input_box;
-    if (!input_filename.empty() && input_filename != "-") {
-        input_box = make_unique<ifstream>(input_filename);
-        if (!input_box->good()) {
-            throw runtime_error("Failed to open input file");
-        }
-        input_stream = input_box.get();
-    } else if (isatty(STDIN_FILENO)) {
+    // Set up input & output, sharing one thread pool for BGZF (de)compression
+    if (input_filename.empty()) {
+        input_filename = "-";
+    }
+    if (input_filename == "-" && isatty(STDIN_FILENO)) {
         help_codec(mode);
         return -1;
     }
-
-    ostream *output_stream = &cout;
-    unique_ptr<ofstream> output_box;
-    if (!output_filename.empty()) {
-        output_box = make_unique<ofstream>(output_filename);
-        if (output_box->bad()) {
-            throw runtime_error("Failed to open output file");
+    if (output_filename.empty()) {
+        output_filename = "-";
+    }
+    if (!output_type) {
+        const size_t n = output_filename.size();
+        output_type = (n > 3 && output_filename.substr(n - 3) == ".gz") ? 'z' : 'u';
+        if (mode == CodecMode::decode && n > 4 && output_filename.substr(n - 4) == ".bcf") {
+            output_type = 'b';
         }
-        output_stream = output_box.get();
     }
-    output_stream->setf(ios_base::unitbuf);
+    if (checkpoint_bytes && thread_count > 1) {
+        // the multithreaded encoder divides the input by line count, so it can't place these
+        cerr << "spvcf: --checkpoint-bytes is incompatible with --threads (try --column-threads)"
+             << endl;
+        return -1;
+    }
+    if (output_type == 'b' && (with_missing_fields || index || thread_count > 1)) {
+        cerr << "spvcf: BCF output is incompatible with --with-missing-fields, --index and "
+                "--threads"
+             << endl;
+        return -1;
+    }
+    unique_ptr<hts_tpool, void (*)(hts_tpool *)> bgzf_pool(nullptr, hts_tpool_destroy);
+    if (bgzf_threads) {
+        bgzf_pool.reset(hts_tpool_init(bgzf_threads));
+        if (!bgzf_pool) {
+            throw runtime_error("Failed to start BGZF thread pool");
+        }
+    }
+    // open the input with htslib first, to detect BCF (to encode)
+    htsFile *hts_input = hts_open(input_filename.c_str(), "r");
+    if (!hts_input) {
+        throw runtime_error("Failed to open input file");
+    }
+    unique_ptr<htsFile, int (*)(htsFile *)> bcf_input(nullptr, hts_close);
+    unique_ptr<spVCF::LineReader> input;
+    if (hts_get_format(hts_input)->format == bcf) {
+        bcf_input.reset(hts_input);
+        if (reads_spvcf(mode)) {
+            cerr << "spvcf: input is BCF, not spVCF" << endl;
+            return -1;
+        }
+        if (thread_count > 1) {
+            cerr << "spvcf: --threads doesn't support BCF input (try --column-threads)" << endl;
+            return -1;
+        }
+        htsThreadPool tp = {bgzf_pool.get(), 0};
+        if (bgzf_pool && hts_set_thread_pool(bcf_input.get(), &tp) != 0) {
+            throw runtime_error("Failed to set up BGZF thread pool");
+        }
+    } else {
+        input = make_unique<spVCF::LineReader>(hts_input, bgzf_pool.get());
+    }
+    if (output_type == 'b') {
+        return decode_bcf(*input, output_filename, samples, bgzf_pool.get(), quiet);
+    }
+    auto output =
+        make_unique<spVCF::FileWriter>(output_filename, output_type == 'z', bgzf_pool.get());
+    if (index) {
+        output->Index(csi);
+    }
+    if (checkpoint_index) {
+        output->IndexCheckpoints();
+    }
+    if (align_checkpoints) {
+        output->AlignCheckpoints();
+    }
 
     // Encode or decode
     spVCF::transcode_stats stats;
-    if (thread_count <= 1) {
+    if (bcf_input) {
+        auto encoder = spVCF::NewRowEncoder(checkpoint_period, (mode == CodecMode::encode),
+                                            squeeze, roundDP_base, column_threads,
+                                            checkpoint_bytes);
+        encode_bcf(bcf_input.get(), *encoder, *output);
+        stats = encoder->Stats();
+    } else if (thread_count <= 1) {
         unique_ptr<spVCF::Transcoder> tc;
         if (mode == CodecMode::decode) {
-            tc = spVCF::NewDecoder(with_missing_fields);
+            tc = spVCF::NewDecoder(with_missing_fields, samples);
+        } else if (mode == CodecMode::subset) {
+            tc = spVCF::NewSubsetter(samples);
+        } else if (mode == CodecMode::sitestats) {
+            tc = spVCF::NewSiteStats();
         } else {
             tc = spVCF::NewEncoder(checkpoint_period, (mode == CodecMode::encode), squeeze,
-                                   roundDP_base);
+                                   roundDP_base, column_threads, checkpoint_bytes);
         }
-        string input_line;
-        if (getline(*input_stream, input_line)) {
-            check_input_format(mode, input_line);
+        size_t len;
+        char *input_line = input->NextLine(len);
+        if (input_line) {
+            check_input_format(mode, string(input_line, len));
             do {
-                *output_stream << tc->ProcessLine(&input_line[0]);
-                *output_stream << '\n';
-                if (input_stream->fail() || input_stream->bad() || !output_stream->good()) {
-                    throw runtime_error("I/O error");
-                }
-            } while (getline(*input_stream, input_line));
-        }
-        if (!input_stream->eof() || input_stream->bad()) {
-            throw runtime_error("I/O error");
+                const char *output_line = tc->ProcessLine(input_line);
+                output->Write(output_line, tc->OutputLength());
+                output->Write('\n');
+            } while ((input_line = input->NextLine(len)));
         }
         stats = tc->Stats();
     } else {
-        assert(mode != CodecMode::decode);
-        stats = multithreaded_encode(mode, checkpoint_period, squeeze, roundDP_base, thread_count,
-                                     *input_stream, *output_stream);
+        auto new_codec = [&]() {
+            if (mode == CodecMode::decode) {
+                return spVCF::NewDecoder(with_missing_fields, samples);
+            } else if (mode == CodecMode::subset) {
+                return spVCF::NewSubsetter(samples);
+            } else if (mode == CodecMode::sitestats) {
+                return spVCF::NewSiteStats();
+            }
+            return spVCF::NewEncoder(checkpoint_period, (mode == CodecMode::encode), squeeze,
+                                     roundDP_base, column_threads);
+        };
+        stats = multithreaded_codec(mode, new_codec, checkpoint_period, thread_count,
+                                    *input, *output);
     }
 
     // Close up
-    if (output_box) {
-        output_box->close();
-        if (output_box->fail()) {
-            throw runtime_error("Failed to close output file");
-        }
-    }
+    output->Close();
 
     // Output stats
     if (!quiet) {
-        cerr.imbue(locale(""));
-        cerr << "N = " << fixed << stats.N << endl;
-        cerr << "dense cells = " << fixed << stats.N * stats.lines << endl;
-        if (squeeze) {
-            cerr << "squeezed cells = " << fixed << stats.squeezed_cells << endl;
-        }
-        if (mode != CodecMode::squeeze_only) {
-            cerr << "sparse cells = " << fixed << stats.sparse_cells << endl;
-            cerr << "lines (non-header) = " << fixed << stats.lines << endl;
-            cerr << "lines (75% sparse) = " << fixed << stats.sparse75_lines << endl;
-            cerr << "lines (90% sparse) = " << fixed << stats.sparse90_lines << endl;
-            cerr << "lines (99% sparse) = " << fixed << stats.sparse99_lines << endl;
-        }
-        if (mode == CodecMode::encode) {
-            cerr << "checkpoints = " << fixed << stats.checkpoints << endl;
-        }
+        print_stats(mode, squeeze, stats);
     }
 
     return 0;
@@ -399,21 +869,26 @@ void help_tabix() {
          << endl
          << "spvcf tabix [options] in.spvcf.gz chr1:1000-2000 [chr2 ...]" << endl
          << "Requires tabix index present e.g. in.spvcf.gz.tbi. Includes all header lines." << endl
+         << "Uses the checkpoint sidecar in.spvcf.gz.ckpt too, if present." << endl
          << endl
          << "Options:" << endl
          << "  -o,--output out.spvcf  Write to out.spvcf instead of standard output" << endl
+         << "  -t,--threads N         Slice N regions at a time (output remains in order)" << endl
          << "  -h,--help              Show this help message" << endl
          << endl;
 }
 
 int main_tabix(int argc, char *argv[]) {
     string output_filename;
+    size_t thread_count = 1;
 
-    static struct option long_options[] = {
-        {"help", no_argument, 0, 'h'}, {"output", required_argument, 0, 'o'}, {0, 0, 0, 0}};
+    static struct option long_options[] = {{"help", no_argument, 0, 'h'},
+                                           {"output", required_argument, 0, 'o'},
+                                           {"threads", required_argument, 0, 't'},
+                                           {0, 0, 0, 0}};
 
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "ho:", long_options, nullptr))) {
+    while (-1 != (c = getopt_long(argc, argv, "ho:t:", long_options, nullptr))) {
         switch (c) {
         case 'h':
             help_tabix();
@@ -425,6 +900,14 @@ int main_tabix(int argc, char *argv[]) {
                 return -1;
             }
             break;
+        case 't':
+            errno = 0;
+            thread_count = strtoull(optarg, nullptr, 10);
+            if (errno) {
+                cerr << "spvcf: couldn't parse --threads" << endl;
+                return -1;
+            }
+            break;
         default:
             help_tabix();
             return -1;
@@ -452,7 +935,92 @@ int main_tabix(int argc, char *argv[]) {
         output_stream = output_box.get();
     }
 
-    spVCF::TabixSlice(input_filename, regions, *output_stream);
+    spVCF::TabixSlice(input_filename, regions, *output_stream, thread_count);
+    return 0;
+}
+
+void help_samplestats() {
+    cout << "spvcf samplestats: per-sample QC statistics of Sparse Project VCF" << endl;
+    cout << GIT_REVISION << "    " << __TIMESTAMP__ << endl
+         << endl
+         << "spvcf samplestats [options] [in.spvcf|-]" << endl
+         << "Reads spVCF text from standard input if filename is empty or -" << endl
+         << "Input may be uncompressed, gzip or bgzip" << endl
+         << endl
+         << "Options:" << endl
+         << "  -o,--output out.tsv    Write to out.tsv instead of standard output" << endl
+         << "  -t,--threads N         Process N chromosomes at a time, using the tabix index of"
+         << endl
+         << "                           the bgzip input file (output remains in order)" << endl
+         << "  -h,--help              Show this help message" << endl
+         << endl
+         << "Writes a table with a row for each chromosome & sample, with the number of sites and"
+         << endl
+         << "of those where the sample's GT is missing (not fully called), heterozygous, or"
+         << endl
+         << "non-reference (any ALT allele), and its mean DP." << endl
+         << endl;
+}
+
+int main_samplestats(int argc, char *argv[]) {
+    string output_filename;
+    size_t thread_count = 1;
+
+    static struct option long_options[] = {{"help", no_argument, 0, 'h'},
+                                           {"output", required_argument, 0, 'o'},
+                                           {"threads", required_argument, 0, 't'},
+                                           {0, 0, 0, 0}};
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "ho:t:", long_options, nullptr))) {
+        switch (c) {
+        case 'h':
+            help_samplestats();
+            return 0;
+        case 'o':
+            output_filename = string(optarg);
+            if (output_filename.empty()) {
+                help_samplestats();
+                return -1;
+            }
+            break;
+        case 't':
+            errno = 0;
+            thread_count = strtoull(optarg, nullptr, 10);
+            if (errno) {
+                cerr << "spvcf: couldn't parse --threads" << endl;
+                return -1;
+            }
+            break;
+        default:
+            help_samplestats();
+            return -1;
+        }
+    }
+
+    string input_filename = "-";
+    if (optind == argc - 1) {
+        input_filename = string(argv[optind]);
+    } else if (optind != argc) {
+        help_samplestats();
+        return -1;
+    }
+    if (input_filename == "-" && (isatty(STDIN_FILENO) || thread_count > 1)) {
+        help_samplestats();
+        return -1;
+    }
+
+    ostream *output_stream = &cout;
+    unique_ptr<ofstream> output_box;
+    if (!output_filename.empty()) {
+        output_box = make_unique<ofstream>(output_filename);
+        if (output_box->bad()) {
+            throw runtime_error("Failed to open output file");
+        }
+        output_stream = output_box.get();
+    }
+
+    spVCF::SampleStats(input_filename, *output_stream, thread_count);
     return 0;
 }
 
@@ -461,11 +1029,14 @@ void help() {
     cout << GIT_REVISION << "    " << __TIMESTAMP__ << endl
          << endl
          << "subcommands:" << endl
-         << "  encode   encode Project VCF to spVCF" << endl
-         << "  squeeze  squeeze Project VCF" << endl
-         << "  decode   decode spVCF to Project VCF" << endl
-         << "  tabix    use a .tbi index to slice a spVCF bgzip file by genomic range" << endl
-         << "  help     show this help message" << endl
+         << "  encode      encode Project VCF to spVCF" << endl
+         << "  squeeze     squeeze Project VCF" << endl
+         << "  decode      decode spVCF to Project VCF" << endl
+         << "  subset      subset samples of spVCF, keeping it sparse" << endl
+         << "  sitestats   compute per-site genotype statistics (AC, AN etc.) of spVCF" << endl
+         << "  samplestats compute per-sample QC statistics of spVCF" << endl
+         << "  tabix       use a .tbi index to slice a spVCF bgzip file by genomic range" << endl
+         << "  help        show this help message" << endl
          << endl;
 }
 
@@ -488,6 +1059,12 @@ int main(int argc, char *argv[]) {
         return main_codec(argc, argv, CodecMode::squeeze_only);
     } else if (subcommand == "decode") {
         return main_codec(argc, argv, CodecMode::decode);
+    } else if (subcommand == "subset") {
+        return main_codec(argc, argv, CodecMode::subset);
+    } else if (subcommand == "sitestats") {
+        return main_codec(argc, argv, CodecMode::sitestats);
+    } else if (subcommand == "samplestats") {
+        return main_samplestats(argc, argv);
     } else if (subcommand == "tabix") {
         return main_tabix(argc, argv);
     }
@@ -0,0 +1,241 @@
+// Line-oriented input from a file (uncompressed, gzip or BGZF), handing out each line as a
+// writable, NUL-terminated string in place within a large buffer (so it can be passed straight
+// to Transcoder::ProcessLine, without copying it into a std::string first).
+//
+// A background thread reads the input into a few large blocks, each holding whole lines, so that
+// the next block is read while the current one is being processed. Compressed input is detected
+// automatically, and BGZF decompression may be spread across an htslib thread pool. (Mapping
+// regular files into memory was tried too, but overwriting the newlines with NULs makes the
+// kernel copy every page of the mapping, which costs more than read() does.)
+#pragma once
+
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include "htslib/bgzf.h"
+#include "htslib/hts.h"
+#include "htslib/thread_pool.h"
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spVCF {
+
+class LineReader {
+  public:
+    static const size_t block_size = 4 << 20; // initial size of each block
+    static const size_t blocks = 3;           // blocks in circulation between the threads
+
+    // Read filename, or standard input if "-". If pool is given, use it for BGZF decompression.
+    explicit LineReader(const std::string &filename = "-", hts_tpool *pool = nullptr) {
+        fp_ = bgzf_open(filename.c_str(), "r");
+        if (!fp_) {
+            throw std::runtime_error("Failed to open input file");
+        }
+        start(pool);
+    }
+
+    // Read the text of a file already opened by htslib hts_open() (e.g. to detect its format),
+    // taking ownership of it
+    explicit LineReader(htsFile *hts, hts_tpool *pool = nullptr) : hts_(hts) {
+        fp_ = hts_get_bgzfp(hts);
+        if (!fp_) {
+            hts_close(hts);
+            throw std::runtime_error("Failed to open input file");
+        }
+        start(pool);
+    }
+
+    LineReader(const LineReader &) = delete;
+
+    ~LineReader() {
+        if (reader_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            reader_.join();
+        }
+        for (Block *block : free_) {
+            delete block;
+        }
+        for (Block *block : filled_) {
+            delete block;
+        }
+        delete cur_;
+        close();
+    }
+
+    // Get the next line, without its newline, or nullptr at the end of the input. The line may
+    // be modified by the caller, and remains valid until the next call.
+    char *NextLine(size_t &len) {
+        for (;;) {
+            if (cur_ && pos_ < cur_->size) {
+                char *line = cur_->data + pos_;
+                char *nl = (char *)memchr(line, '\n', cur_->size - pos_);
+                if (!nl) {
+                    // last line of the input lacks a newline; there's room for the NUL anyway
+                    nl = cur_->data + cur_->size;
+                }
+                *nl = 0;
+                len = nl - line;
+                pos_ = nl - cur_->data + 1;
+                return line;
+            }
+            if (!next_block()) {
+                return nullptr;
+            }
+        }
+    }
+
+  private:
+    void start(hts_tpool *pool) {
+        if (pool && bgzf_compression(fp_) == bgzf && bgzf_thread_pool(fp_, pool, 0) != 0) {
+            close();
+            throw std::runtime_error("Failed to set up BGZF thread pool");
+        }
+        for (size_t i = 0; i < blocks; i++) {
+            free_.push_back(new Block(block_size));
+        }
+        reader_ = std::thread([this]() { read_loop(); });
+    }
+
+    void close() {
+        if (hts_) {
+            hts_close(hts_);
+        } else {
+            bgzf_close(fp_);
+        }
+    }
+
+    struct Block {
+        char *data = nullptr;
+        size_t size = 0, capacity = 0; // data is allocated with capacity+1 bytes
+
+        explicit Block(size_t cap) { reserve(cap); }
+        ~Block() { free(data); }
+
+        void reserve(size_t cap) {
+            if (cap > capacity) {
+                char *p = (char *)realloc(data, cap + 1);
+                if (!p) {
+                    throw std::bad_alloc();
+                }
+                data = p;
+                capacity = cap;
+            }
+        }
+    };
+
+    // recycle the current block and wait for the reader thread to fill the next one
+    bool next_block() {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (cur_) {
+            free_.push_back(cur_);
+            cur_ = nullptr;
+            cv_.notify_all();
+        }
+        cv_.wait(lock, [this] { return !filled_.empty() || done_; });
+        if (filled_.empty()) {
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+            return false;
+        }
+        cur_ = filled_.front();
+        filled_.erase(filled_.begin());
+        pos_ = 0;
+        return true;
+    }
+
+    // reader thread: fill blocks, passing each on once it's full, ending at its last newline;
+    // the partial line following that is moved to the start of the next block.
+    void read_loop() {
+        Block *block = nullptr;
+        try {
+            block = take_free();
+            while (block) {
+                if (block->size == block->capacity) {
+                    char *nl = (char *)memrchr(block->data, '\n', block->size);
+                    if (!nl) {
+                        // line longer than the block
+                        block->reserve(2 * block->capacity);
+                        continue;
+                    }
+                    Block *next = take_free();
+                    if (!next) {
+                        break;
+                    }
+                    size_t keep = nl + 1 - block->data;
+                    next->reserve(block->size - keep);
+                    next->size = block->size - keep;
+                    memcpy(next->data, nl + 1, next->size);
+                    block->size = keep;
+                    put_filled(block);
+                    block = next;
+                    continue; // next may be full already
+                }
+                ssize_t n =
+                    bgzf_read(fp_, block->data + block->size, block->capacity - block->size);
+                if (n < 0) {
+                    throw std::runtime_error("I/O error reading or decompressing input");
+                }
+                if (n == 0) {
+                    if (block->size) {
+                        put_filled(block);
+                        block = nullptr;
+                    }
+                    break;
+                }
+                block->size += n;
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mu_);
+            error_ = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        if (block) {
+            free_.push_back(block);
+        }
+        done_ = true;
+        cv_.notify_all();
+    }
+
+    Block *take_free() {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this] { return !free_.empty() || stop_; });
+        if (stop_) {
+            return nullptr;
+        }
+        Block *block = free_.back();
+        free_.pop_back();
+        block->size = 0;
+        return block;
+    }
+
+    void put_filled(Block *block) {
+        std::lock_guard<std::mutex> lock(mu_);
+        filled_.push_back(block);
+        cv_.notify_all();
+    }
+
+    BGZF *fp_;
+    htsFile *hts_ = nullptr; // owning fp_, if any
+
+    // the reader thread takes free_ blocks & passes them back filled_
+    std::thread reader_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::vector<Block *> free_, filled_;
+    Block *cur_ = nullptr; // block being consumed
+    size_t pos_ = 0;       // position of the next line in cur_
+    bool done_ = false, stop_ = false;
+    std::exception_ptr error_;
+};
+
+} // namespace spVCF
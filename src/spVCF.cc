@@ -1,49 +1,65 @@
 #include "spVCF.h"
+#include "reader.h"
+#include "split.h"
+#include "htslib/bgzf.h"
 #include "htslib/kseq.h"
 #include "htslib/kstring.h"
 #include "htslib/tbx.h"
+#include "htslib/vcf.h"
 #include "strlcpy.h"
 #include <algorithm>
 #include <assert.h>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
 namespace spVCF {
 
-// split s on delim & return strlen(s). s is damaged by side-effect
-template <typename Out>
-size_t split(char *s, char delim, Out result, uint64_t maxsplit = ULLONG_MAX) {
-    string delims("\n");
-    delims[0] = delim;
-    char *cursor = s;
-    char *token = strsep(&cursor, delims.c_str());
-    char *last_token = token;
-    uint64_t i = 0;
-    while (token) {
-        *(result++) = last_token = token;
-        if (++i < maxsplit) {
-            token = strsep(&cursor, delims.c_str());
-        } else {
-            if (cursor) {
-                *result = last_token = cursor;
-            }
-            break;
-        }
+// Sizes below 8 have their own buckets; above, each power of two [2^e, 2^(e+1)) is divided into
+// eight buckets of width 2^(e-3), by the three bits following the leading one.
+int transcode_stats::interval_bucket(uint64_t bytes) {
+    if (bytes < 8) {
+        return int(bytes);
     }
-    return last_token ? (last_token + strlen(last_token) - s) : 0;
+    const int e = 63 - __builtin_clzll(bytes);
+    return 8 * (e - 2) + int((bytes >> (e - 3)) & 7);
 }
 
-template <typename Out>
-size_t split(string &s, char delim, Out result, uint64_t maxsplit = ULLONG_MAX) {
-    return split(&s[0], delim, result, maxsplit);
+// Find the bucket of the nearest-rank percentile, and report its greatest size (or the maximum)
+uint64_t transcode_stats::checkpoint_interval_percentile(unsigned pct) const {
+    uint64_t intervals = 0;
+    for (int i = 0; i < interval_buckets; i++) {
+        intervals += checkpoint_interval_hist[i];
+    }
+    const uint64_t rank = max(uint64_t(1), (intervals * pct + 99) / 100);
+    uint64_t seen = 0;
+    for (int i = 0; i < interval_buckets; i++) {
+        seen += checkpoint_interval_hist[i];
+        if (seen >= rank) {
+            if (i < 8) {
+                return i;
+            }
+            const int e = i / 8 + 2;
+            const uint64_t lo = uint64_t(8 + i % 8) << (e - 3);
+            return min(lo + ((uint64_t(1) << (e - 3)) - 1), max_checkpoint_interval_bytes);
+        }
+    }
+    return max_checkpoint_interval_bytes;
 }
 
 // because std::ostringstream is too slow :(
@@ -87,7 +103,34 @@ class OStringStream {
         Add(s);
         return *this;
     }
-    inline OStringStream &operator<<(const std::string &s) { return *this << s.c_str(); }
+    inline OStringStream &operator<<(const std::string &s) {
+        Add(s.data(), s.size());
+        return *this;
+    }
+
+    void Add(const char *s, size_t len) {
+        if (remaining() < len) {
+            grow(len - remaining());
+        }
+        memcpy(&buf_[cursor_], s, len);
+        cursor_ += len;
+        buf_[cursor_] = 0;
+    }
+
+    // decimal formatting of unsigned integers
+    void Add(uint64_t n) {
+        char digits[20];
+        size_t i = sizeof(digits);
+        do {
+            digits[--i] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        Add(digits + i, sizeof(digits) - i);
+    }
+    inline OStringStream &operator<<(uint64_t n) {
+        Add(n);
+        return *this;
+    }
 
     inline const char *Get() const {
         assert(buf_[cursor_] == 0);
@@ -101,6 +144,12 @@ class OStringStream {
 
     void Clear() { buf_[0] = cursor_ = 0; }
 
+    void Swap(OStringStream &other) {
+        swap(buf_, other.buf_);
+        swap(buf_size_, other.buf_size_);
+        swap(cursor_, other.cursor_);
+    }
+
   private:
     inline size_t remaining() const {
         assert(buf_[cursor_] == 0);
@@ -122,8 +171,229 @@ class OStringStream {
     size_t buf_size_, cursor_;
 };
 
+// Cheap 32-bit fingerprint of a cell, to reject most mismatches without
+// comparing the bytes
+static inline uint32_t fingerprint(const char *s, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, s + i, len - i);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    h ^= h >> 29;
+    return uint32_t(h);
+}
+
+// The last cell recorded densely for each of N columns, kept in one contiguous
+// arena instead of N separately-allocated strings. An updated cell overwrites
+// its column's current slot if it fits, otherwise it's bump-allocated at the
+// end of the arena. The garbage left behind is reclaimed by Rewrite() at each
+// checkpoint, which re-lays out every column in order, or by compacting in
+// place if the arena fills up in between.
+class DenseCells {
+  public:
+    DenseCells() : arena_(nullptr, free) {}
+    DenseCells(const DenseCells &) = delete;
+
+    void Reset(uint64_t N) {
+        columns_.assign(N, Column());
+        arena_.reset();
+        arena_size_ = arena_used_ = 0;
+    }
+
+    inline uint64_t Size() const { return columns_.size(); }
+    inline bool Empty() const { return columns_.empty(); }
+
+    // does column s hold a (nonempty) cell equal to t?
+    inline bool Matches(uint64_t s, const char *t, uint32_t len, uint32_t hash) const {
+        const Column &c = columns_[s];
+        return c.len == len && c.hash == hash && len &&
+               memcmp(arena_.get() + c.offset, t, len) == 0;
+    }
+
+    inline const char *Get(uint64_t s) const {
+        const Column &c = columns_[s];
+        return c.len != UNSET ? arena_.get() + c.offset : nullptr;
+    }
+
+    // Update column s in place if t fits in its current slot, returning false if it doesn't.
+    // Safe to call concurrently for distinct columns.
+    inline bool Overwrite(uint64_t s, const char *t, uint32_t len, uint32_t hash) {
+        Column &c = columns_[s];
+        if (c.len == UNSET || len > c.len) {
+            return false;
+        }
+        c.len = len;
+        c.hash = hash;
+        memcpy(arena_.get() + c.offset, t, len);
+        arena_.get()[c.offset + len] = 0;
+        return true;
+    }
+
+    inline void Set(uint64_t s, const char *t, uint32_t len, uint32_t hash) {
+        if (Overwrite(s, t, len, hash)) {
+            return;
+        }
+        Column &c = columns_[s];
+        c.len = UNSET;
+        if (arena_used_ + len + 1 > arena_size_) {
+            make_room(len + 1);
+        }
+        c.offset = arena_used_;
+        arena_used_ += len + 1;
+        c.len = len;
+        c.hash = hash;
+        memcpy(arena_.get() + c.offset, t, len);
+        arena_.get()[c.offset + len] = 0;
+    }
+
+    // Overwrite all columns with the given cells, leaving no garbage
+    void Rewrite(char *const *cells) {
+        size_t total = 0;
+        for (uint64_t s = 0; s < columns_.size(); s++) {
+            Column &c = columns_[s];
+            c.len = strlen(cells[s]);
+            total += c.len + 1;
+        }
+        if (total > arena_size_) {
+            // no need to preserve the current contents
+            arena_.reset();
+            arena_size_ = total + total / 4;
+            arena_.reset((char *)malloc(arena_size_));
+            if (!arena_) {
+                throw bad_alloc();
+            }
+        }
+        arena_used_ = 0;
+        for (uint64_t s = 0; s < columns_.size(); s++) {
+            Column &c = columns_[s];
+            c.offset = arena_used_;
+            c.hash = fingerprint(cells[s], c.len);
+            memcpy(arena_.get() + arena_used_, cells[s], c.len + 1);
+            arena_used_ += c.len + 1;
+        }
+    }
+
+  private:
+    static const uint32_t UNSET = UINT32_MAX;
+    struct Column {
+        uint64_t offset = 0;
+        uint32_t len = UNSET; // UNSET if the column has no cell yet
+        uint32_t hash = 0;
+    };
+
+    // Ensure room to bump-allocate `extra` bytes: compact the arena in place if at least a
+    // quarter of it is garbage, and/or grow it by half.
+    void make_room(size_t extra) {
+        size_t live = 0;
+        for (const auto &c : columns_) {
+            live += (c.len != UNSET) ? c.len + 1 : 0;
+        }
+        if (arena_used_ - live >= arena_size_ / 4) {
+            order_.clear(); // columns with cells, in arena order
+            for (uint64_t s = 0; s < columns_.size(); s++) {
+                if (columns_[s].len != UNSET) {
+                    order_.push_back(s);
+                }
+            }
+            sort(order_.begin(), order_.end(), [this](uint64_t lhs, uint64_t rhs) {
+                return columns_[lhs].offset < columns_[rhs].offset;
+            });
+            size_t used = 0;
+            for (auto s : order_) {
+                Column &c = columns_[s];
+                assert(used <= c.offset);
+                memmove(arena_.get() + used, arena_.get() + c.offset, c.len + 1);
+                c.offset = used;
+                used += c.len + 1;
+            }
+            assert(used == live);
+            arena_used_ = used;
+        }
+        if (arena_used_ + extra > arena_size_) {
+            size_t new_size = max(arena_size_, size_t(4096));
+            while (arena_used_ + extra > new_size) {
+                new_size += new_size / 2;
+            }
+            // realloc can often grow large blocks without copying
+            char *arena = (char *)realloc(arena_.get(), new_size);
+            if (!arena) {
+                throw bad_alloc();
+            }
+            arena_.release();
+            arena_.reset(arena);
+            arena_size_ = new_size;
+        }
+    }
+
+    vector<Column> columns_;
+    vector<uint64_t> order_; // temp buffer used in make_room (to reduce allocations)
+    unique_ptr<char, decltype(&free)> arena_;
+    size_t arena_size_ = 0, arena_used_ = 0; // invariant: arena_used_ <= arena_size_
+};
+
+// Walk the cells of a spVCF row (tokens[9] onward) across its N columns, calling f(lo, hi, cell)
+// for each: the explicit cell of column lo (with hi = lo+1), or cell = nullptr for a run of quotes
+// over columns [lo, hi). Checks that the cells imply exactly N columns, reporting any problem by
+// fail(msg), which throws.
+template <class Fail, class F>
+static void for_sparse_cells(const vector<char *> &tokens, uint64_t N, Fail fail, F f) {
+    uint64_t dense_cursor = 0;
+    for (uint64_t t = 9; t < tokens.size(); t++) {
+        const char *cell = tokens[t];
+        uint64_t r = 1;
+        if (*cell == 0) {
+            fail("empty cell");
+        } else if (*cell == '"') {
+            if (cell[1]) {
+                errno = 0;
+                r = strtoull(cell + 1, nullptr, 10);
+                if (errno || !r) {
+                    fail("Undecodable sparse cell");
+                }
+            }
+        }
+        if (r > N - dense_cursor) {
+            ostringstream msg;
+            msg << "Greater-than-expected number of columns implied by sparse encoding"
+                << " (expected N=" << N << ")";
+            fail(msg.str());
+        }
+        f(dense_cursor, dense_cursor + r, *cell == '"' ? nullptr : cell);
+        dense_cursor += r;
+    }
+    if (dense_cursor != N) {
+        ostringstream msg;
+        msg << "Unexpected number of columns implied by sparse encoding"
+            << " (expected N=" << N << ", got " << dense_cursor << ")";
+        fail(msg.str());
+    }
+}
+
+// Tally a row whose sparse encoding has sparse_cells cells for N columns
+static void count_sparse_row(transcode_stats &stats, uint64_t sparse_cells, uint64_t N) {
+    stats.sparse_cells += sparse_cells;
+    auto sparse_pct = 100 * sparse_cells / N;
+    if (sparse_pct <= 25) {
+        ++stats.sparse75_lines;
+    }
+    if (sparse_pct <= 10) {
+        ++stats.sparse90_lines;
+    }
+    if (sparse_pct <= 1) {
+        ++stats.sparse99_lines;
+    }
+}
+
 // Base class for encoder/decoder with common state & error-handling
-class TranscoderBase : public Transcoder {
+template <class Interface = Transcoder> class TranscoderBase : public Interface {
   public:
     TranscoderBase() = default;
     TranscoderBase(const TranscoderBase &) = delete;
@@ -142,31 +412,217 @@ class TranscoderBase : public Transcoder {
     transcode_stats stats_;
 };
 
-class EncoderImpl : public TranscoderBase {
+// Persistent worker threads for processing the stripes of each row concurrently. They're parked
+// on a condition variable between rows, so that a row costs a couple of wakeups instead of
+// starting new threads (and allocating their futures).
+class StripeWorkers {
+  public:
+    StripeWorkers() = default;
+    StripeWorkers(const StripeWorkers &) = delete;
+    ~StripeWorkers() {
+        {
+            lock_guard<mutex> lock(mu_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (auto &t : threads_) {
+            t.join();
+        }
+    }
+
+    // Run job(ctx, k) for each k in [0, n): k = 0 on the calling thread and the rest on the
+    // workers (started on first use), returning once all are done. Rethrows any exception.
+    void Run(size_t n, void (*job)(void *, size_t), void *ctx) {
+        while (threads_.size() + 1 < n) {
+            threads_.emplace_back(&StripeWorkers::worker, this, threads_.size() + 1, generation_);
+        }
+        {
+            lock_guard<mutex> lock(mu_);
+            job_ = job;
+            ctx_ = ctx;
+            n_ = n;
+            pending_ = n - 1;
+            error_ = nullptr;
+            ++generation_;
+        }
+        start_.notify_all();
+        exception_ptr error;
+        try {
+            job(ctx, 0);
+        } catch (...) {
+            error = current_exception();
+        }
+        unique_lock<mutex> lock(mu_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        if (!error) {
+            error = error_;
+        }
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+  private:
+    void worker(size_t k, uint64_t generation) {
+        unique_lock<mutex> lock(mu_);
+        while (true) {
+            start_.wait(lock, [&] { return stop_ || generation_ != generation; });
+            if (stop_) {
+                return;
+            }
+            generation = generation_;
+            if (k >= n_) {
+                continue;
+            }
+            lock.unlock();
+            exception_ptr error;
+            try {
+                job_(ctx_, k);
+            } catch (...) {
+                error = current_exception();
+            }
+            lock.lock();
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--pending_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    vector<thread> threads_;
+    mutex mu_;
+    condition_variable start_, done_;
+    bool stop_ = false;
+    uint64_t generation_ = 0; // incremented by each Run()
+    void (*job_)(void *, size_t) = nullptr;
+    void *ctx_ = nullptr;
+    size_t n_ = 0, pending_ = 0;
+    exception_ptr error_;
+};
+
+class EncoderImpl : public TranscoderBase<RowEncoder> {
   public:
-    EncoderImpl(uint64_t checkpoint_period, bool sparse, bool squeeze, double roundDP_base)
-        : checkpoint_period_(checkpoint_period), sparse_(sparse), squeeze_(squeeze),
-          roundDP_base_(roundDP_base) {}
+    EncoderImpl(uint64_t checkpoint_period, bool sparse, bool squeeze, double roundDP_base,
+                size_t column_threads, uint64_t checkpoint_bytes)
+        : checkpoint_period_(checkpoint_period), checkpoint_bytes_(checkpoint_bytes),
+          sparse_(sparse), squeeze_(squeeze), roundDP_base_(roundDP_base),
+          column_threads_(max(column_threads, size_t(1))) {}
     EncoderImpl(const EncoderImpl &) = delete;
+    ~EncoderImpl() { free(bcf_text_.s); }
     const char *ProcessLine(char *input_line) override;
+    const char *ProcessRow(char *const *columns, size_t n) override;
+    const char *ProcessBCF(bcf_hdr_t *hdr, bcf1_t *rec) override;
+    size_t OutputLength() const override { return buffer_.Size(); }
+    void Restart() override {
+        chrom_.clear();
+        since_checkpoint_ = checkpoint_pos_ = bytes_since_checkpoint_ = 0;
+    }
 
   private:
+    // Beyond roundDP_table_, the rounded DP is a step function of DP: those in [lo, hi) round
+    // down to rDP. roundDP() memoizes the last step it found.
+    struct RoundDPStep {
+        uint64_t lo = 0, hi = 0, rDP = 0;
+    };
+
+    // A contiguous range of columns processed as a unit, possibly concurrently with others. Very
+    // wide rows are divided into several stripes (if column_threads_ > 1), otherwise there's one
+    // stripe spanning all N columns.
+    struct Stripe {
+        // sparse cells, from the first explicit (non-quote) cell through the last
+        OStringStream buffer;
+        bool any_explicit = false;
+        // lengths of the quote runs preceding the first explicit cell and following the last;
+        // these may have to be stitched to runs in adjacent stripes.
+        uint64_t lead = 0, trail = 0;
+        uint64_t sparse_cells = 0; // excluding lead & trail runs
+        uint64_t squeezed_cells = 0;
+        // updated columns whose new cells didn't fit into DenseCells in place
+        vector<uint64_t> deferred;
+        // temp buffers used in squeeze_stripe (to reduce allocations)
+        OStringStream new_cell;
+        vector<char *> entries;
+        RoundDPStep roundDP_step;
+    };
+    static const uint64_t min_stripe_columns = 4096;
+
+    // Field layout of a FORMAT string, for squeezing
+    struct SqueezeLayout {
+        int iDP = -1, iAD = -1, iVR = -1;
+        vector<size_t> permutation; // new field order, beginning with GT:DP
+        string format;              // revised FORMAT
+    };
+
+    const char *encode_row(vector<char *> &tokens);
+    // should the line on chrom be a checkpoint, given it's the since'th since the last one?
+    bool checkpoint_due(const char *chrom, uint64_t since) const {
+        return chrom_ != chrom || (checkpoint_period_ > 0 && since >= checkpoint_period_) ||
+               (checkpoint_bytes_ > 0 && bytes_since_checkpoint_ >= checkpoint_bytes_);
+    }
+    void count_bytes(bool checkpoint);
     bool unquotableGT(const char *entry);
     void Squeeze(const vector<char *> &line);
+    const SqueezeLayout &squeeze_layout(const char *format);
+    void squeeze_stripe(const vector<char *> &line, uint64_t lo, uint64_t hi, Stripe &stripe);
+    double roundDP_k(uint64_t DP) const;
+    uint64_t roundDP_least(double k) const;
+    void roundDP(uint64_t DP, RoundDPStep &step, OStringStream &out) const;
+    void encode_stripe(const vector<char *> &tokens, uint64_t lo, uint64_t hi, Stripe &stripe,
+                       OStringStream &out, bool concurrent);
+    template <typename F> size_t for_stripes(uint64_t N, F f);
 
     uint64_t checkpoint_period_ = 0;
+    // also checkpoint once the output since the last checkpoint reaches this many bytes (if > 0)
+    uint64_t checkpoint_bytes_ = 0;
     bool sparse_ = true;
     bool squeeze_ = false;
 
-    vector<string> dense_entries_; // main state memory
+    DenseCells dense_entries_; // main state memory
     string chrom_;
     uint64_t since_checkpoint_ = 0, checkpoint_pos_ = 0;
+    uint64_t bytes_since_checkpoint_ = 0; // including the checkpoint line
 
     OStringStream buffer_;
-    vector<string> roundDP_table_;
     double roundDP_base_;
+    vector<string> roundDP_table_;
+
+    // SqueezeLayout cache, by FORMAT; in practice FORMAT is the same on most lines
+    unordered_map<string, SqueezeLayout> squeeze_layouts_;
+    string last_format_;
+    const SqueezeLayout *layout_ = nullptr; // current line's
+
+    size_t column_threads_;
+    vector<unique_ptr<Stripe>> stripes_;
+    StripeWorkers workers_; // for stripes_[1..]
+    vector<char *> row_;    // ProcessRow() columns
+    vector<char *> tokens_; // temp buffer used in ProcessLine (to reduce allocations)
+
+    // ProcessBCF(): each column's last formatted cell, as binary values (see bcf_cell_key)
+    DenseCells bcf_keys_;
+    OStringStream bcf_key_;
+    kstring_t bcf_text_ = {0, 0, nullptr}; // the formatted columns, each followed by NUL
+    vector<size_t> bcf_offsets_;           // of the formatted cells in bcf_text_, or SIZE_MAX
 };
 
+// Run f(stripe, lo, hi) on each stripe of the N columns, concurrently if there's more than one.
+// Returns the number of stripes.
+template <typename F> size_t EncoderImpl::for_stripes(uint64_t N, F f) {
+    size_t n_stripes = max(uint64_t(1), min(uint64_t(column_threads_), N / min_stripe_columns));
+    while (stripes_.size() < n_stripes) {
+        stripes_.push_back(make_unique<Stripe>());
+    }
+    if (n_stripes == 1) {
+        f(*stripes_[0], 0, N);
+        return 1;
+    }
+    auto run = [&](size_t k) { f(*stripes_[k], N * k / n_stripes, N * (k + 1) / n_stripes); };
+    workers_.Run(
+        n_stripes, [](void *ctx, size_t k) { (*static_cast<decltype(run) *>(ctx))(k); }, &run);
+    return n_stripes;
+}
+
 #include <iostream>
 const char *EncoderImpl::ProcessLine(char *input_line) {
     ++line_number_;
@@ -178,14 +634,186 @@ const char *EncoderImpl::ProcessLine(char *input_line) {
             buffer_ << "##fileformat=spVCF" << GIT_REVISION << ";" << format;
             return buffer_.Get();
         }
-        return input_line;
+        buffer_.Clear();
+        buffer_ << input_line;
+        return buffer_.Get();
     }
-    ++stats_.lines;
 
     // Split the tab-separated line
-    vector<char *> tokens;
-    tokens.reserve(dense_entries_.size() + 9);
-    size_t linesz = split(input_line, '\t', back_inserter(tokens));
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    return encode_row(tokens_);
+}
+
+const char *EncoderImpl::ProcessRow(char *const *columns, size_t n) {
+    ++line_number_;
+    row_.assign(columns, columns + n);
+    return encode_row(row_);
+}
+
+// The values of sample j's FORMAT field f, normalized to int32_t (or float, or char) regardless of
+// the integer width BCF happens to use in this record, so that cells with the same key format to
+// the same text. Returns false if the field is absent for this sample (no values before
+// vector_end), as htslib reads a trailing field omitted from the VCF text.
+static bool bcf_cell_key(const bcf_fmt_t *f, int j, OStringStream &key) {
+    const uint8_t *p = f->p + j * size_t(f->size);
+    int32_t x = f->id;
+    key.Add((const char *)&x, sizeof(x));
+    const size_t size0 = key.Size();
+    for (int i = 0; i < f->n; i++) {
+        switch (f->type) {
+        case BCF_BT_INT8:
+            x = ((const int8_t *)p)[i];
+            if (x == bcf_int8_vector_end) {
+                i = f->n;
+                continue;
+            }
+            x = x == bcf_int8_missing ? bcf_int32_missing : x;
+            break;
+        case BCF_BT_INT16:
+            x = ((const int16_t *)p)[i];
+            if (x == bcf_int16_vector_end) {
+                i = f->n;
+                continue;
+            }
+            x = x == bcf_int16_missing ? bcf_int32_missing : x;
+            break;
+        case BCF_BT_INT32:
+        case BCF_BT_FLOAT:
+            memcpy(&x, p + i * sizeof(x), sizeof(x));
+            if (x == (f->type == BCF_BT_FLOAT ? int32_t(bcf_float_vector_end)
+                                              : bcf_int32_vector_end)) {
+                i = f->n;
+                continue;
+            }
+            break;
+        case BCF_BT_CHAR:
+            x = p[i];
+            if (!x) {
+                i = f->n;
+                continue;
+            }
+            key.Add(char(x));
+            continue;
+        default:
+            throw runtime_error("spvcf: unsupported BCF FORMAT field type");
+        }
+        key.Add((const char *)&x, sizeof(x));
+    }
+    const bool present = key.Size() > size0;
+    x = bcf_int32_vector_end; // terminator
+    key.Add((const char *)&x, sizeof(x));
+    return present;
+}
+
+// Encode a BCF record. Rather than formatting every cell as text, we first compare the binary
+// values of each cell with those of its column's last formatted cell, and format only the cells
+// that differ, setting the others' tokens to nullptr for encode_row() to treat as matching. But
+// checkpoints (& non-sparse output) need all the cells.
+const char *EncoderImpl::ProcessBCF(bcf_hdr_t *hdr, bcf1_t *rec) {
+    ++line_number_;
+    if (bcf_unpack(rec, BCF_UN_ALL) != 0) {
+        fail("htslib failed to unpack BCF record");
+    }
+    const uint64_t N = rec->n_sample;
+    if (!N || !rec->n_fmt) {
+        fail("Invalid: fewer than 10 columns");
+    }
+
+    // CHROM through INFO, formatted by htslib without the samples
+    bcf_text_.l = 0;
+    rec->n_sample = 0;
+    int ret = vcf_format(hdr, rec, &bcf_text_);
+    rec->n_sample = N;
+    if (ret != 0 || !bcf_text_.l) {
+        fail("htslib failed to format BCF record");
+    }
+    bcf_text_.s[bcf_text_.l - 1] = '\t'; // was newline
+
+    // FORMAT
+    int gt = -1;
+    bool first = true;
+    for (int i = 0; i < rec->n_fmt; i++) {
+        const bcf_fmt_t *f = &rec->d.fmt[i];
+        if (!f->p) {
+            continue;
+        }
+        const char *key = bcf_hdr_int2id(hdr, BCF_DT_ID, f->id);
+        if (!strcmp(key, "GT")) {
+            gt = i;
+        }
+        if ((!first && kputc(':', &bcf_text_) < 0) || kputs(key, &bcf_text_) < 0) {
+            throw bad_alloc();
+        }
+        first = false;
+    }
+    if (kputc('\0', &bcf_text_) < 0) {
+        throw bad_alloc();
+    }
+
+    // Format the cells that differ from their columns' last (or all of them)
+    const bool all = !sparse_ || dense_entries_.Size() != N ||
+                     checkpoint_due(bcf_seqname(hdr, rec), since_checkpoint_ + 1);
+    if (bcf_keys_.Size() != N) {
+        bcf_keys_.Reset(N);
+    }
+    bcf_offsets_.assign(N, SIZE_MAX);
+    for (uint64_t s = 0; s < N; s++) {
+        bcf_key_.Clear();
+        int last = -1; // last field present for this sample
+        for (int i = 0; i < rec->n_fmt; i++) {
+            if (rec->d.fmt[i].p && bcf_cell_key(&rec->d.fmt[i], s, bcf_key_)) {
+                last = i;
+            }
+        }
+        const uint32_t len = bcf_key_.Size(), hash = fingerprint(bcf_key_.Get(), len);
+        if (!all && bcf_keys_.Matches(s, bcf_key_.Get(), len, hash)) {
+            continue;
+        }
+        bcf_keys_.Set(s, bcf_key_.Get(), len, hash);
+
+        // as in htslib vcf_format(), except that trailing absent fields are omitted (as in the
+        // VCF text they were likely parsed from, and as spvcf decode writes them), and others are
+        // written as missing
+        bcf_offsets_[s] = bcf_text_.l;
+        first = true;
+        for (int i = 0; i <= last; i++) {
+            bcf_fmt_t *f = &rec->d.fmt[i];
+            if (!f->p) {
+                continue;
+            }
+            if (!first && kputc(':', &bcf_text_) < 0) {
+                throw bad_alloc();
+            }
+            first = false;
+            const size_t l0 = bcf_text_.l;
+            if (i == gt) {
+                bcf_format_gt(f, s, &bcf_text_);
+            } else {
+                bcf_fmt_array(&bcf_text_, f->n, f->type, f->p + s * size_t(f->size));
+            }
+            if (bcf_text_.l == l0 && kputc('.', &bcf_text_) < 0) {
+                throw bad_alloc();
+            }
+        }
+        if ((first && kputc('.', &bcf_text_) < 0) || kputc('\0', &bcf_text_) < 0) {
+            throw bad_alloc();
+        }
+    }
+
+    row_.clear();
+    split(bcf_text_.s, '\t', back_inserter(row_));
+    if (row_.size() != 9) {
+        fail("Invalid: unexpected tab in BCF record");
+    }
+    for (uint64_t s = 0; s < N; s++) {
+        row_.push_back(bcf_offsets_[s] != SIZE_MAX ? bcf_text_.s + bcf_offsets_[s] : nullptr);
+    }
+    return encode_row(row_);
+}
+
+const char *EncoderImpl::encode_row(vector<char *> &tokens) {
+    ++stats_.lines;
     if (tokens.size() < 10) {
         fail("Invalid: fewer than 10 columns");
     }
@@ -194,10 +822,10 @@ const char *EncoderImpl::ProcessLine(char *input_line) {
     }
 
     uint64_t N = tokens.size() - 9;
-    if (dense_entries_.empty()) { // First line: allocate the dense entries
-        dense_entries_.resize(N);
+    if (dense_entries_.Empty()) { // First line: allocate the dense entries
+        dense_entries_.Reset(N);
         stats_.N = N;
-    } else if (dense_entries_.size() != N) { // Subsequent line -- check expected # columns
+    } else if (dense_entries_.Size() != N) { // Subsequent line -- check expected # columns
         for (int i = 9; i < tokens.size(); i++) {
             const string t = tokens[i];
             if (!t.empty() && t[0] == '"') {
@@ -225,14 +853,11 @@ const char *EncoderImpl::ProcessLine(char *input_line) {
             // access & partial decoding of the file.
             //
             // TODO: create an appropriate header line for spVCF_checkpointPOS?
-            string INFO = tokens[7];
-            string newINFO;
-            if (!INFO.empty() && INFO != ".") {
-                newINFO = INFO;
-                newINFO = ";" + newINFO;
+            const char *INFO = tokens[7];
+            buffer_ << "spVCF_checkpointPOS=" << checkpoint_pos_;
+            if (*INFO && strcmp(INFO, ".")) {
+                buffer_ << ';' << INFO;
             }
-            newINFO = "spVCF_checkpointPOS=" + to_string(checkpoint_pos_) + newINFO;
-            buffer_ << newINFO;
         }
     }
 
@@ -243,61 +868,23 @@ const char *EncoderImpl::ProcessLine(char *input_line) {
         return buffer_.Get();
     }
 
-    uint64_t quote_run = 0; // current run-length of quotes across the row
-    uint64_t sparse_cells = 0;
-    // Iterate over the columns, compare each entry with the last entry
-    // recorded densely.
-    for (uint64_t s = 0; s < N; s++) {
-        string &m = dense_entries_[s];
-        const char *t = tokens[s + 9];
-        if (*t == '"') {
-            fail("Input seems to be sparse-encoded already");
-        }
-        if (m.empty() || strcmp(m.c_str(), t) != 0 || unquotableGT(t)) {
-            // Entry doesn't match the last one recorded densely for this
-            // column. Output any accumulated run of quotes in the current row,
-            // then this new entry, and update the state appropriately.
-            if (quote_run) {
-                buffer_ << "\t\"";
-                if (quote_run > 1) {
-                    buffer_ << to_string(quote_run);
-                }
-                quote_run = 0;
-                ++sparse_cells;
-            }
-            buffer_ << '\t' << t;
-            ++sparse_cells;
-            m = t;
-        } else {
-            // Entry matches; add to the current run of quotes
-            quote_run++;
-        }
-    }
-    // Output final run of quotes
-    if (quote_run) {
-        buffer_ << "\t\"";
-        if (quote_run > 1) {
-            buffer_ << to_string(quote_run);
-        }
-        ++sparse_cells;
-    }
-
     // CHECKPOINT -- return a densely-encoded row -- if we've switched to a new
-    // chromosome OR we've hit the specified period
+    // chromosome OR we've hit the specified period. (No need to compare the
+    // columns with the state memory, since the checkpoint resets all of it.)
     ++since_checkpoint_;
-    if (chrom_ != tokens[0] ||
-        (checkpoint_period_ > 0 && since_checkpoint_ >= checkpoint_period_)) {
+    if (checkpoint_due(tokens[0], since_checkpoint_)) {
         buffer_.Clear();
         for (int t = 0; t < tokens.size(); t++) {
             if (t > 0) {
                 buffer_ << '\t';
             }
-            buffer_ << tokens[t];
-            if (t >= 9) {
-                dense_entries_[t - 9] = tokens[t];
+            if (t >= 9 && *tokens[t] == '"') {
+                fail("Input seems to be sparse-encoded already");
             }
-            assert(tokens.size() == stats_.N + 9);
+            buffer_ << tokens[t];
         }
+        assert(tokens.size() == stats_.N + 9);
+        dense_entries_.Rewrite(&tokens[9]);
         since_checkpoint_ = 0;
         errno = 0;
         uint64_t POS = strtoull(tokens[1], nullptr, 10);
@@ -310,24 +897,137 @@ const char *EncoderImpl::ProcessLine(char *input_line) {
         checkpoint_pos_ = POS;
         chrom_ = tokens[0];
         ++stats_.checkpoints;
+        count_bytes(true);
         return buffer_.Get();
     }
 
-    stats_.sparse_cells += sparse_cells;
-    auto sparse_pct = 100 * sparse_cells / N;
-    if (sparse_pct <= 25) {
-        ++stats_.sparse75_lines;
-    }
-    if (sparse_pct <= 10) {
-        ++stats_.sparse90_lines;
-    }
-    if (sparse_pct <= 1) {
-        ++stats_.sparse99_lines;
+    // Iterate over the columns, compare each entry with the last entry
+    // recorded densely. If the row is divided into several stripes, each one is
+    // encoded concurrently into its own buffer, then they're stitched together
+    // here, merging quote runs that span stripe boundaries.
+    uint64_t sparse_cells = 0, quote_run = 0;
+    auto add_quote_run = [&]() {
+        if (quote_run) {
+            buffer_ << "\t\"";
+            if (quote_run > 1) {
+                buffer_ << quote_run;
+            }
+            quote_run = 0;
+            ++sparse_cells;
+        }
+    };
+    size_t n_stripes = for_stripes(N, [&](Stripe &stripe, uint64_t lo, uint64_t hi) {
+        if (lo == 0 && hi == N) {
+            encode_stripe(tokens, lo, hi, stripe, buffer_, false);
+        } else {
+            encode_stripe(tokens, lo, hi, stripe, stripe.buffer, true);
+        }
+    });
+    for (size_t k = 0; k < n_stripes; k++) {
+        Stripe &stripe = *stripes_[k];
+        quote_run += stripe.lead;
+        if (stripe.any_explicit) {
+            add_quote_run();
+            if (n_stripes > 1) {
+                buffer_.Add(stripe.buffer.Get(), stripe.buffer.Size());
+            }
+            quote_run = stripe.trail;
+        }
+        sparse_cells += stripe.sparse_cells;
+        for (auto s : stripe.deferred) {
+            const char *t = tokens[s + 9];
+            const uint32_t len = strlen(t);
+            dense_entries_.Set(s, t, len, fingerprint(t, len));
+        }
     }
+    // Output final run of quotes
+    add_quote_run();
 
+    count_sparse_row(stats_, sparse_cells, N);
+
+    count_bytes(false);
     return buffer_.Get();
 }
 
+// Account for the output line (& newline) in the current checkpoint interval, which begins anew
+// with a checkpoint line
+void EncoderImpl::count_bytes(bool checkpoint) {
+    const uint64_t bytes = buffer_.Size() + 1;
+    uint64_t *hist = stats_.checkpoint_interval_hist;
+    if (!checkpoint && bytes_since_checkpoint_) {
+        // the current interval moves to the bucket of its new size
+        --hist[transcode_stats::interval_bucket(bytes_since_checkpoint_)];
+    }
+    bytes_since_checkpoint_ = (checkpoint ? 0 : bytes_since_checkpoint_) + bytes;
+    ++hist[transcode_stats::interval_bucket(bytes_since_checkpoint_)];
+    stats_.sparse_bytes += bytes;
+    stats_.max_checkpoint_interval_bytes =
+        max(stats_.max_checkpoint_interval_bytes, bytes_since_checkpoint_);
+}
+
+// Encode columns [lo, hi) of the row into out. The quote run preceding the first explicit cell
+// is held back in stripe.lead if concurrent (for stitching), otherwise it's output directly.
+// The run following the last explicit cell is always left in stripe.trail (or stripe.lead if
+// there are no explicit cells). Concurrent stripes mustn't reallocate DenseCells, so they defer
+// those updates to the caller.
+void EncoderImpl::encode_stripe(const vector<char *> &tokens, uint64_t lo, uint64_t hi,
+                                Stripe &stripe, OStringStream &out, bool concurrent) {
+    stripe.buffer.Clear();
+    stripe.any_explicit = false;
+    stripe.lead = stripe.trail = stripe.sparse_cells = 0;
+    stripe.deferred.clear();
+
+    uint64_t quote_run = 0; // current run-length of quotes across the stripe
+    for (uint64_t s = lo; s < hi; s++) {
+        const char *t = tokens[s + 9];
+        // (from ProcessBCF) nullptr if the cell is the same as the column's last
+        const bool unchanged = !t;
+        uint32_t len = 0, hash = 0;
+        if (unchanged) {
+            t = dense_entries_.Get(s);
+        } else {
+            if (*t == '"') {
+                fail("Input seems to be sparse-encoded already");
+            }
+            len = strlen(t);
+            hash = fingerprint(t, len);
+        }
+        if ((!unchanged && !dense_entries_.Matches(s, t, len, hash)) || unquotableGT(t)) {
+            // Entry doesn't match the last one recorded densely for this
+            // column. Output any accumulated run of quotes in the current row,
+            // then this new entry, and update the state appropriately.
+            if (quote_run) {
+                if (concurrent && !stripe.any_explicit) {
+                    stripe.lead = quote_run;
+                } else {
+                    out << "\t\"";
+                    if (quote_run > 1) {
+                        out << quote_run;
+                    }
+                    ++stripe.sparse_cells;
+                }
+                quote_run = 0;
+            }
+            out << '\t' << t;
+            ++stripe.sparse_cells;
+            stripe.any_explicit = true;
+            if (!unchanged && !concurrent) {
+                dense_entries_.Set(s, t, len, hash);
+            } else if (!unchanged && !dense_entries_.Overwrite(s, t, len, hash)) {
+                stripe.deferred.push_back(s);
+            }
+        } else {
+            // Entry matches; add to the current run of quotes
+            quote_run++;
+        }
+    }
+    if (stripe.any_explicit) {
+        stripe.trail = quote_run;
+    } else {
+        stripe.lead = quote_run;
+    }
+}
+
 // Determine if the entry's GT makes it "unquotable", meaning the called
 // allele(s) don't consist of all 0 or all .
 // A half-call like ./0 is considered unquotable.
@@ -367,64 +1067,171 @@ void EncoderImpl::Squeeze(const vector<char *> &line) {
         // precompute a lookup table for rounding down DP values
         roundDP_table_.push_back("0");
         for (uint64_t DP = 1; DP < 10000; DP++) {
-            uint64_t rDP = uint64_t(pow(roundDP_base_, floor(log(DP) / log(roundDP_base_))));
+            uint64_t rDP = uint64_t(pow(roundDP_base_, roundDP_k(DP)));
             assert(rDP <= DP);
             roundDP_table_.push_back(to_string(rDP));
         }
     }
 
-    // parse the FORMAT field
-    vector<string> format;
-    size_t formatsz = split(line[8], ':', back_inserter(format));
+    // look up the field layout for this FORMAT, and update it
+    layout_ = &squeeze_layout(line[8]);
+    assert(layout_->format.size() == strlen(line[8]));
+    memcpy(line[8], layout_->format.c_str(), layout_->format.size());
 
-    // locate fields of interest
-    assert(format[0] == "GT");
-    int iDP = -1;
-    auto pDP = find(format.begin(), format.end(), "DP");
-    if (pDP != format.end()) {
-        iDP = pDP - format.begin();
-        assert(iDP > 0 && iDP < format.size());
-    }
-    int iAD = -1;
-    auto pAD = find(format.begin(), format.end(), "AD");
-    if (pAD != format.end()) {
-        iAD = pAD - format.begin();
-        assert(iAD > 0 && iAD < format.size());
-    }
-    int iVR = -1;
-    auto pVR = find(format.begin(), format.end(), "VR");
-    if (pVR != format.end()) {
-        iVR = pVR - format.begin();
-        assert(iVR > 0 && iVR < format.size());
-    }
-
-    // compute the new field order and update FORMAT
-    vector<size_t> permutation;
-    permutation.push_back(0);
-    if (iDP >= 1) {
-        permutation.push_back(iDP);
-    }
-    for (size_t i = 1; i < format.size(); i++) {
-        if (i != iDP) {
-            permutation.push_back(i);
-        }
-    }
-    OStringStream new_format;
-    new_format << "GT";
-    for (const auto i : permutation) {
-        if (i > 0) {
-            new_format << ":" << format[i];
-        }
+    // proceed through all cells, in stripes
+    const uint64_t N = line.size() - 9;
+    size_t n_stripes = for_stripes(N, [&](Stripe &stripe, uint64_t lo, uint64_t hi) {
+        squeeze_stripe(line, lo, hi, stripe);
+    });
+    for (size_t k = 0; k < n_stripes; k++) {
+        stats_.squeezed_cells += stripes_[k]->squeezed_cells;
     }
-    assert(new_format.Size() <= formatsz);
-    strcpy(line[8], new_format.Get());
+}
 
-    // reusable buffers to save allocations in upcoming inner loop
-    OStringStream new_cell;
-    vector<char *> entries;
+const EncoderImpl::SqueezeLayout &EncoderImpl::squeeze_layout(const char *format) {
+    if (layout_ && last_format_ == format) {
+        return *layout_;
+    }
+    last_format_ = format;
+    auto p = squeeze_layouts_.find(last_format_);
+    if (p != squeeze_layouts_.end()) {
+        return p->second;
+    }
+    if (squeeze_layouts_.size() >= 1000) {
+        squeeze_layouts_.clear();
+    }
+    SqueezeLayout &layout = squeeze_layouts_[last_format_];
 
-    // proceed through all cells
-    for (int s = 9; s < line.size(); s++) {
+    // parse the FORMAT field
+    vector<string> fields;
+    string format_copy = last_format_;
+    split(format_copy, ':', back_inserter(fields));
+
+    // locate fields of interest
+    assert(fields[0] == "GT");
+    auto pDP = find(fields.begin(), fields.end(), "DP");
+    if (pDP != fields.end()) {
+        layout.iDP = pDP - fields.begin();
+        assert(layout.iDP > 0 && layout.iDP < fields.size());
+    }
+    auto pAD = find(fields.begin(), fields.end(), "AD");
+    if (pAD != fields.end()) {
+        layout.iAD = pAD - fields.begin();
+        assert(layout.iAD > 0 && layout.iAD < fields.size());
+    }
+    auto pVR = find(fields.begin(), fields.end(), "VR");
+    if (pVR != fields.end()) {
+        layout.iVR = pVR - fields.begin();
+        assert(layout.iVR > 0 && layout.iVR < fields.size());
+    }
+
+    // compute the new field order and FORMAT
+    layout.permutation.push_back(0);
+    if (layout.iDP >= 1) {
+        layout.permutation.push_back(layout.iDP);
+    }
+    for (size_t i = 1; i < fields.size(); i++) {
+        if (i != layout.iDP) {
+            layout.permutation.push_back(i);
+        }
+    }
+    layout.format = "GT";
+    for (const auto i : layout.permutation) {
+        if (i > 0) {
+            layout.format += ":" + fields[i];
+        }
+    }
+    return layout;
+}
+
+// The exponent k of the power of roundDP_base_ to which DP rounds down. log() may put a large DP
+// just below a power of the base at that power, in which case we take the one below.
+double EncoderImpl::roundDP_k(uint64_t DP) const {
+    const double k = floor(log(DP) / log(roundDP_base_));
+    const double rDP = pow(roundDP_base_, k);
+    return k > 0 && (rDP >= ldexp(1.0, 64) || uint64_t(rDP) > DP) ? k - 1 : k;
+}
+
+// The least DP beyond roundDP_table_ with roundDP_k(DP) >= k, or UINT64_MAX if none. The estimate
+// base^k may be off by many units for large DP, so from there we gallop to bracket the boundary,
+// then bisect: O(log distance) evaluations of roundDP_k().
+uint64_t EncoderImpl::roundDP_least(double k) const {
+    const double approx = pow(roundDP_base_, k);
+    if (approx >= ldexp(1.0, 64)) {
+        return UINT64_MAX;
+    }
+    const uint64_t least = roundDP_table_.size();
+    auto reaches = [&](uint64_t DP) { return roundDP_k(DP) >= k; };
+    // bracket the boundary in (lo, hi]: reaches(hi) and !reaches(lo)
+    uint64_t lo, hi = max(uint64_t(ceil(approx)), least), step = 1;
+    if (reaches(hi)) {
+        while (true) {
+            if (hi == least) {
+                return least;
+            }
+            lo = hi - least > step ? hi - step : least;
+            if (!reaches(lo)) {
+                break;
+            }
+            hi = lo;
+            step = step > UINT64_MAX / 2 ? UINT64_MAX : 2 * step;
+        }
+    } else {
+        lo = hi;
+        while (true) {
+            if (lo == UINT64_MAX) {
+                return UINT64_MAX;
+            }
+            hi = UINT64_MAX - lo > step ? lo + step : UINT64_MAX;
+            if (reaches(hi)) {
+                break;
+            }
+            lo = hi;
+            step = step > UINT64_MAX / 2 ? UINT64_MAX : 2 * step;
+        }
+    }
+    while (hi - lo > 1) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        (reaches(mid) ? hi : lo) = mid;
+    }
+    return hi;
+}
+
+// Round down DP to a power of roundDP_base_. Beyond the lookup table, this finds the step
+// containing DP only if it's not the same as the last one's.
+void EncoderImpl::roundDP(uint64_t DP, RoundDPStep &step, OStringStream &out) const {
+    if (DP < roundDP_table_.size()) {
+        out << roundDP_table_[DP];
+        return;
+    }
+    if (DP < step.lo || DP >= step.hi) {
+        const double k = roundDP_k(DP);
+        step.lo = roundDP_least(k);
+        step.hi = roundDP_least(k + 1);
+        step.rDP = uint64_t(pow(roundDP_base_, k));
+        if (DP < step.lo || DP >= step.hi) {
+            // shouldn't happen given monotone log(), but don't rely on it
+            step.lo = DP;
+            step.hi = DP + 1;
+        }
+    }
+    assert(step.rDP <= DP);
+    out << step.rDP;
+}
+
+// Squeeze cells [lo, hi) of the line, using the field layout prepared by Squeeze()
+void EncoderImpl::squeeze_stripe(const vector<char *> &line, uint64_t lo, uint64_t hi,
+                                 Stripe &stripe) {
+    OStringStream &new_cell = stripe.new_cell;
+    vector<char *> &entries = stripe.entries;
+    const int iDP = layout_->iDP, iAD = layout_->iAD, iVR = layout_->iVR;
+    const vector<size_t> &permutation = layout_->permutation;
+    stripe.squeezed_cells = 0;
+
+    for (uint64_t s = lo + 9; s < hi + 9; s++) {
+        if (!line[s]) {
+            continue; // (from ProcessBCF) unchanged, so already squeezed
+        }
         entries.clear();
         // parse individual entries
         size_t cellsz = split(line[s], ':', back_inserter(entries));
@@ -466,14 +1273,7 @@ void EncoderImpl::Squeeze(const vector<char *> &line) {
                         fail("Couldn't parse DP");
                     }
                     new_cell << ':';
-                    if (DP < roundDP_table_.size()) {
-                        new_cell << roundDP_table_[DP];
-                    } else {
-                        uint64_t rDP =
-                            uint64_t(pow(roundDP_base_, floor(log(DP) / log(roundDP_base_))));
-                        assert(rDP <= DP);
-                        new_cell << to_string(rDP);
-                    }
+                    roundDP(DP, stripe.roundDP_step, new_cell);
                 } else {
                     new_cell << ':' << entries[iDP];
                 }
@@ -482,7 +1282,7 @@ void EncoderImpl::Squeeze(const vector<char *> &line) {
             }
         }
         if (truncate) {
-            ++stats_.squeezed_cells;
+            ++stripe.squeezed_cells;
         } else {
             // Even if we're not lossily truncating QC fields in this pVCF cell,
             // it may have a trailing run of missing values which we can omit
@@ -521,35 +1321,149 @@ void EncoderImpl::Squeeze(const vector<char *> &line) {
 }
 
 unique_ptr<Transcoder> NewEncoder(uint64_t checkpoint_period, bool sparse, bool squeeze,
-                                  double roundDP_base) {
-    return make_unique<EncoderImpl>(checkpoint_period, sparse, squeeze, roundDP_base);
+                                  double roundDP_base, size_t column_threads,
+                                  uint64_t checkpoint_bytes) {
+    return make_unique<EncoderImpl>(checkpoint_period, sparse, squeeze, roundDP_base,
+                                    column_threads, checkpoint_bytes);
+}
+
+unique_ptr<RowEncoder> NewRowEncoder(uint64_t checkpoint_period, bool sparse, bool squeeze,
+                                     double roundDP_base, size_t column_threads,
+                                     uint64_t checkpoint_bytes) {
+    return make_unique<EncoderImpl>(checkpoint_period, sparse, squeeze, roundDP_base,
+                                    column_threads, checkpoint_bytes);
+}
+
+// Resolve sample names to their columns in the #CHROM header line (in ascending order), and output
+// the header line with only those columns. Returns the total number of columns N.
+static uint64_t SelectSamples(char *header_line, const vector<string> &samples,
+                              vector<uint64_t> &selected, OStringStream &out) {
+    vector<char *> tokens;
+    split(header_line, '\t', back_inserter(tokens));
+    if (tokens.size() < 10) {
+        throw runtime_error("spvcf: invalid #CHROM header line: fewer than 10 columns");
+    }
+    unordered_map<string, uint64_t> columns;
+    for (uint64_t i = 9; i < tokens.size(); i++) {
+        columns[tokens[i]] = i - 9;
+    }
+    selected.clear();
+    for (const auto &sample : samples) {
+        auto c = columns.find(sample);
+        if (c == columns.end()) {
+            throw runtime_error("spvcf: sample " + sample + " not found in #CHROM header line");
+        }
+        selected.push_back(c->second);
+    }
+    sort(selected.begin(), selected.end());
+    selected.erase(unique(selected.begin(), selected.end()), selected.end());
+
+    out << tokens[0];
+    for (int i = 1; i < 9; i++) {
+        out << '\t' << tokens[i];
+    }
+    for (uint64_t c : selected) {
+        out << '\t' << tokens[c + 9];
+    }
+    return tokens.size() - 9;
 }
 
-class DecoderImpl : public TranscoderBase {
+class DecoderImpl : public TranscoderBase<> {
   public:
-    DecoderImpl(bool with_missing_fields) : with_missing_fields_(with_missing_fields) {}
+    DecoderImpl(bool with_missing_fields, const vector<string> &samples)
+        : with_missing_fields_(with_missing_fields), samples_(samples) {}
     DecoderImpl(const DecoderImpl &) = delete;
     const char *ProcessLine(char *input_line) override;
+    size_t OutputLength() const override { return buffer_.Size(); }
+    void Restart() override { reset_row(); }
+    void SkipLine(char *input_line) override;
 
   private:
-    void add_missing_fields(const char *entry, int n_alt, string &ans);
+    // --with-missing-fields: how to pad the cells of a given FORMAT & number of ALT alleles
+    struct MissingFields {
+        int n_alt = 0, iDP = -1, iAD = -1;
+        vector<char> number; // of each field: 'A', 'R' or 'G' if a vector to pad, else 0
+        string AD_zeros;     // ",0" for each ALT allele (AD of a non-variant GT is {DP},0,...)
+        // Fill templates by GT ploidy, built as needed: fills[i] is field i's missing value, and
+        // suffixes[k] the ':'-separated fills of fields k and on, with AD_pos[k] the position of
+        // the AD fill within it (or npos).
+        struct Template {
+            vector<string> fills, suffixes;
+            vector<size_t> AD_pos;
+        };
+        vector<unique_ptr<Template>> templates;
+    };
+    void update_missing_fields(const char *format, int n_alt);
+    const MissingFields::Template &missing_fields_template(size_t ploidy);
+    void add_missing_fields(const char *entry, size_t len);
+    uint64_t columns(const vector<char *> &tokens);
+    void select_samples(char *header_line); // --samples
+    void reset_row();
+    // move the last row decoded out of buffer_, before buffer_ is overwritten
+    inline void stash_row() {
+        if (row_in_buffer_) {
+            row_.Swap(buffer_);
+            row_in_buffer_ = false;
+        }
+    }
+    void decode_cells(const vector<char *> &tokens, uint64_t N);
+    void splice_skipped();
+    // append the cells [first, last) of a row (laid out as in row_) to out, with their offsets
+    static void copy_span(const OStringStream &row, const vector<uint64_t> &offsets,
+                          uint64_t first, uint64_t last, OStringStream &out,
+                          vector<uint64_t> &out_offsets) {
+        const uint64_t lo = offsets[first], hi = offsets[last];
+        const uint64_t delta = out.Size() - lo;
+        out.Add(row.Get() + lo, hi - lo);
+        for (uint64_t p = first; p < last; p++) {
+            out_offsets[p] = offsets[p] + delta;
+        }
+    }
 
-    // temp buffers used in ProcessLine (to reduce allocations)
-    vector<string> dense_entries_;
+    uint64_t N_ = 0;
+    // output buffer, which also retains the matrix part of the last row decoded
     OStringStream buffer_;
+    // The remembered dense cells, for each of the N columns (or each of the selected_ columns),
+    // are the matrix part of the last row decoded, kept in row_ (swapped out of buffer_ when the
+    // next row begins) with column p spanning [row_offsets_[p], row_offsets_[p+1]) including its
+    // leading tab. A run of quoted cells is thus copied by one memcpy, and only the dense cells
+    // are spliced in between.
+    OStringStream row_;
+    vector<uint64_t> row_offsets_, next_offsets_;
+    vector<char *> tokens_; // temp buffer used in ProcessLine (to reduce allocations)
+    bool row_in_buffer_ = false; // buffer_ holds the last row (not a header line since)
+    bool row_incomplete_ = true; // no row decoded since the start or Restart()
+    // The explicit cells of lines given to SkipLine() since the last decoded row, in order, to be
+    // spliced into row_ by the next ProcessLine(): column p's cell (with leading tab) is at
+    // [offset, offset+len) in skipped_text_. The last one recorded for a column prevails.
+    struct SkippedCell {
+        uint64_t p, offset, len;
+    };
+    vector<SkippedCell> skipped_;
+    OStringStream skipped_text_;
 
     bool with_missing_fields_;
-    string format_;
-    vector<string> format_split_;
-    int iGT_ = -1, iDP_ = -1, iAD_ = -1, iPL_ = -1;
-    // temp buffers used in add_missing_fields (to reduce allocations)
-    OStringStream format_buffer_;
-    string entry_copy_;
-    vector<char *> entry_fields_;
+    // --samples: names & the corresponding columns in ascending order, to be resolved from the
+    // #CHROM header line
+    vector<string> samples_;
+    vector<uint64_t> selected_;
+    // --with-missing-fields: the Number of each FORMAT field declared in the header, and the
+    // MissingFields of each FORMAT & n_alt seen, with those of the current line and of row_ (whose
+    // cells are padded accordingly). raw_row_ has the last row's cells before padding, laid out
+    // like row_, to be padded anew if the next line changes the layout.
+    unordered_map<string, char> format_numbers_;
+    unordered_map<string, unique_ptr<MissingFields>> missing_fields_cache_;
+    string last_format_;
+    int last_n_alt_ = -1;
+    MissingFields *layout_ = nullptr;
+    const MissingFields *row_layout_ = nullptr;
+    OStringStream raw_row_, raw_next_;
+    vector<uint64_t> raw_offsets_, raw_next_offsets_;
 };
 
 const char *DecoderImpl::ProcessLine(char *input_line) {
     ++line_number_;
+    stash_row();
     // Pass through header lines
     if (*input_line == 0 || *input_line == '#') {
         if (strncmp(input_line, "##fileformat=spVCF", 18) == 0) {
@@ -560,42 +1474,43 @@ const char *DecoderImpl::ProcessLine(char *input_line) {
                 return buffer_.Get();
             }
         }
-        return input_line;
+        if (with_missing_fields_ && strncmp(input_line, "##FORMAT=<ID=", 13) == 0) {
+            const char *id = input_line + 13, *number = strstr(input_line, ",Number=");
+            if (number && strchr("ARG", number[8]) && strchr(",>", number[9])) {
+                format_numbers_[string(id, strcspn(id, ",>"))] = number[8];
+            }
+        }
+        buffer_.Clear();
+        if (!samples_.empty() && strncmp(input_line, "#CHROM\t", 7) == 0) {
+            select_samples(input_line);
+        } else {
+            buffer_ << input_line;
+        }
+        return buffer_.Get();
     }
     ++stats_.lines;
 
     // Split the tab-separated line
-    vector<char *> tokens;
-    tokens.reserve(dense_entries_.size());
+    vector<char *> &tokens = tokens_;
+    tokens.clear();
     split(input_line, '\t', back_inserter(tokens));
     if (tokens.size() < 10) {
         fail("Invalid project VCF: fewer than 10 columns");
     }
 
-    int n_alt = -1;
     if (with_missing_fields_) {
         // count n_alt for use in missing fields with Number={A,G,R}
-        n_alt = 1;
+        int n_alt = strcmp(tokens[4], ".") ? 1 : 0;
         for (char *alt = tokens[4]; *alt; alt++) {
             if (*alt == ',') {
                 n_alt++;
             }
         }
-        if (n_alt != 1) {
-            // FIXME: handling multiallelic sites will require add_missing_fields() even on sparse
-            //        entries
-            fail("--with-missing-fields only works with biallelic pVCF for now"
-                 "; try piping output through bcftools instead");
-        }
+        update_missing_fields(tokens[8], n_alt);
     }
 
-    // Figure out number of dense columns, the number of columns on the first line
-    uint64_t N = dense_entries_.empty() ? (tokens.size() - 9) : dense_entries_.size();
-    if (dense_entries_.empty()) {
-        dense_entries_.resize(N);
-        stats_.N = N;
-    }
-    assert(dense_entries_.size() == N);
+    const uint64_t N = columns(tokens);
+    splice_skipped();
 
     // Pass through first nine columns
     buffer_.Clear();
@@ -604,406 +1519,1995 @@ const char *DecoderImpl::ProcessLine(char *input_line) {
         buffer_ << '\t';
         if (i == 7) {
             // Strip the spVCF_checkpointPOS INFO field if present
-            string INFO = tokens[7];
-            if (INFO.substr(0, 20) == "spVCF_checkpointPOS=") {
-                auto p = INFO.find(';');
-                if (p != string::npos) {
-                    buffer_ << INFO.substr(p + 1);
-                } else {
-                    buffer_ << '.';
-                }
+            if (strncmp(tokens[7], "spVCF_checkpointPOS=", 20) == 0) {
+                const char *p = strchr(tokens[7], ';');
+                buffer_ << (p ? p + 1 : ".");
                 continue;
             }
-        } else if (i == 8 && with_missing_fields_) {
-            if (format_.empty()) {
-                // one-time initialization
-                format_ = tokens[8];
-                string format_copy = format_;
-                vector<char *> format_split;
-                split(format_copy, ':', back_inserter(format_split));
-                for (int j = 0; j < format_split.size(); j++) {
-                    char *s = format_split[j];
-                    if (!strcmp(s, "GT")) {
-                        iGT_ = j;
-                    } else if (!strcmp(s, "DP")) {
-                        iDP_ = j;
-                    } else if (!strcmp(s, "AD")) {
-                        iAD_ = j;
-                    } else if (!strcmp(s, "PL")) {
-                        iPL_ = j;
-                    }
-                    format_split_.push_back(s);
-                }
-            }
-            if (format_ != tokens[8]) {
-                fail(
-                    "--with-missing-fields is unsuitable when pVCF lines have varying field FORMATs"
-                    "; try piping output through bcftools instead");
-            }
         }
         buffer_ << tokens[i];
     }
 
-    // Iterate over the sparse columns
-    uint64_t sparse_cells = (tokens.size() - 9), dense_cursor = 0;
-    for (uint64_t sparse_cursor = 0; sparse_cursor < sparse_cells; sparse_cursor++) {
-        const char *t = tokens[sparse_cursor + 9];
-        if (*t == 0) {
-            fail("empty cell");
-        } else if (*t != '"') {
-            // Dense entry - remember it and copy it to the output
-            if (dense_cursor >= N) {
-                fail("Greater-than-expected number of columns implied by sparse encoding");
+    decode_cells(tokens, N);
+    count_sparse_row(stats_, tokens.size() - 9, N);
+
+    return buffer_.Get();
+}
+
+// Append the matrix part of the row to buffer_, copying each run of quoted cells from the last
+// row, and remember it. If selecting samples, then we remember & output only the selected
+// columns, with selected_[k] the next one.
+// With --with-missing-fields, the quoted cells are copied likewise if the line has the same
+// FORMAT & n_alt as the last, otherwise they're padded anew from the raw cells.
+void DecoderImpl::decode_cells(const vector<char *> &tokens, uint64_t N) {
+    const bool selecting = !samples_.empty();
+    const bool repad = with_missing_fields_ && row_layout_ != layout_;
+    if (with_missing_fields_) {
+        raw_next_.Clear();
+    }
+    uint64_t k = 0;
+    auto decode = [&](uint64_t lo, uint64_t hi, const char *t) {
+        if (t) {
+            // Dense entry - copy it to the output
+            uint64_t p = lo;
+            if (selecting) {
+                if (k >= selected_.size() || selected_[k] != p) {
+                    return;
+                }
+                p = k++;
             }
-            string &dense_entry = dense_entries_[dense_cursor++];
+            next_offsets_[p] = buffer_.Size();
+            buffer_ << '\t';
             if (with_missing_fields_) {
-                add_missing_fields(t, n_alt, dense_entry);
+                raw_next_offsets_[p] = raw_next_.Size();
+                raw_next_ << '\t' << t;
+                add_missing_fields(t, raw_next_.Size() - raw_next_offsets_[p] - 1);
             } else {
-                dense_entry = t;
+                buffer_ << t;
             }
-            buffer_ << '\t' << dense_entry;
-        } else {
-            // Sparse entry - determine the run length
-            uint64_t r = 1;
-            if (t[1]) { // strlen(t) > 1
-                errno = 0;
-                auto s = strtoull(t + 1, nullptr, 10);
-                if (errno) {
-                    fail("Undecodable sparse cell");
-                }
-                r = s;
-            }
-            // Output the implied run of entries from the remembered state
-            if (dense_cursor + r > N) {
-                ostringstream msg;
-                msg << "Greater-than-expected number of columns implied by sparse encoding"
-                    << " (expected N=" << N << ")";
-                fail(msg.str());
-            }
-            for (uint64_t p = 0; p < r; p++) {
-                if (dense_entries_[dense_cursor].empty()) {
-                    fail("Missing preceding dense cells");
+            return;
+        }
+        // Sparse entry - output the implied run of entries from the remembered row
+        uint64_t first = lo, last = hi;
+        if (selecting) {
+            first = k;
+            while (k < selected_.size() && selected_[k] < hi) {
+                ++k;
+            }
+            last = k;
+        }
+        if (first < last) {
+            if (row_incomplete_) {
+                fail("Missing preceding dense cells");
+            }
+            if (with_missing_fields_) {
+                copy_span(raw_row_, raw_offsets_, first, last, raw_next_, raw_next_offsets_);
+            }
+            if (!repad) {
+                copy_span(row_, row_offsets_, first, last, buffer_, next_offsets_);
+            } else {
+                for (uint64_t p = first; p < last; p++) {
+                    const uint64_t begin = raw_offsets_[p] + 1, end = raw_offsets_[p + 1];
+                    next_offsets_[p] = buffer_.Size();
+                    buffer_ << '\t';
+                    add_missing_fields(raw_row_.Get() + begin, end - begin);
                 }
-                buffer_ << '\t' << dense_entries_[dense_cursor++];
             }
-            assert(dense_cursor <= N);
         }
+    };
+    for_sparse_cells(tokens, N, [this](const string &msg) { fail(msg); }, decode);
+
+    // Every column now has a cell, and buffer_ holds the row to be remembered
+    next_offsets_.back() = buffer_.Size();
+    swap(row_offsets_, next_offsets_);
+    row_in_buffer_ = true;
+    row_incomplete_ = false;
+    if (with_missing_fields_) {
+        raw_next_offsets_.back() = raw_next_.Size();
+        swap(raw_offsets_, raw_next_offsets_);
+        raw_row_.Swap(raw_next_);
+        row_layout_ = layout_;
     }
-    if (dense_cursor != N) {
-        ostringstream msg;
-        msg << "Unexpected number of columns implied by sparse encoding"
-            << " (expected N=" << N << ", got " << dense_cursor << ")";
-        fail(msg.str());
+}
+
+// Record the line's explicit cells, to be spliced into the remembered row by the next
+// ProcessLine(), and step over each run of quotes in one go. The work is thus proportional to the
+// sparse line length rather than N.
+void DecoderImpl::SkipLine(char *input_line) {
+    if (with_missing_fields_ || *input_line == 0 || *input_line == '#') {
+        ProcessLine(input_line);
+        return;
     }
+    ++line_number_;
+    ++stats_.lines;
 
-    stats_.sparse_cells += sparse_cells;
-    auto sparse_pct = 100 * sparse_cells / N;
-    if (sparse_pct <= 25) {
-        ++stats_.sparse75_lines;
+    vector<char *> &tokens = tokens_;
+    tokens.clear();
+    split(input_line, '\t', back_inserter(tokens));
+    if (tokens.size() < 10) {
+        fail("Invalid project VCF: fewer than 10 columns");
     }
-    if (sparse_pct <= 10) {
-        ++stats_.sparse90_lines;
+    const uint64_t N = columns(tokens);
+    const bool selecting = !samples_.empty();
+    auto skip = [&](uint64_t lo, uint64_t hi, const char *t) {
+        uint64_t p = lo;
+        if (selecting) {
+            // the first selected column at or after lo
+            auto it = lower_bound(selected_.begin(), selected_.end(), lo);
+            if (it == selected_.end() || *it >= hi) {
+                return;
+            }
+            p = it - selected_.begin();
+        }
+        if (!t) {
+            if (row_incomplete_) {
+                fail("Missing preceding dense cells");
+            }
+            return;
+        }
+        const uint64_t offset = skipped_text_.Size();
+        skipped_text_ << '\t' << t;
+        skipped_.push_back({p, offset, skipped_text_.Size() - offset});
+    };
+    for_sparse_cells(tokens, N, [this](const string &msg) { fail(msg); }, skip);
+    row_incomplete_ = false;
+    count_sparse_row(stats_, tokens.size() - 9, N);
+}
+
+// Splice the cells recorded by SkipLine() into the remembered row
+void DecoderImpl::splice_skipped() {
+    if (skipped_.empty()) {
+        return;
     }
-    if (sparse_pct <= 1) {
-        ++stats_.sparse99_lines;
+    stash_row();
+    // by column, then in the order recorded
+    sort(skipped_.begin(), skipped_.end(), [](const SkippedCell &a, const SkippedCell &b) {
+        return a.p < b.p || (a.p == b.p && a.offset < b.offset);
+    });
+    const uint64_t M = row_offsets_.size() - 1;
+    buffer_.Clear();
+    uint64_t p = 0;
+    for (size_t i = 0; i < skipped_.size(); i++) {
+        const SkippedCell &cell = skipped_[i];
+        if (i + 1 < skipped_.size() && skipped_[i + 1].p == cell.p) {
+            continue; // superseded by a later line
+        }
+        copy_span(row_, row_offsets_, p, cell.p, buffer_, next_offsets_);
+        next_offsets_[cell.p] = buffer_.Size();
+        buffer_.Add(skipped_text_.Get() + cell.offset, cell.len);
+        p = cell.p + 1;
     }
-
-    return buffer_.Get();
+    copy_span(row_, row_offsets_, p, M, buffer_, next_offsets_);
+    next_offsets_.back() = buffer_.Size();
+    swap(row_offsets_, next_offsets_);
+    row_.Swap(buffer_);
+    skipped_.clear();
+    skipped_text_.Clear();
 }
 
-// Add trailing missing fields to entry (--with-missing-fields)
-// Most missing fields are just represented by . except for AD and PL, which we pad with . to the
-// correct vector length. (In principle we should do that for any Number={A,G,R} field, but this
-// suffices for our practical need for this feature.)
-// For non-variant genotypes we also fill AD={DP},0 if it'd otherwise be missing.
-void DecoderImpl::add_missing_fields(const char *entry, int n_alt, string &ans) {
-    format_buffer_.Clear();
-    entry_copy_ = entry;
-    entry_fields_.clear();
-    split(entry_copy_, ':', back_inserter(entry_fields_));
-    for (int i = 0; i < format_split_.size(); i++) {
-        bool present = i < entry_fields_.size();
-        const char *field = present ? entry_fields_[i] : nullptr;
-        if (i > 0) {
-            format_buffer_ << ':';
-        }
-        if (i == iAD_ && (!present || !strcmp(field, "."))) {
-            // FIXME: handle multiallelic. Meaning we need to run this on sparse entries too.
-            // const int nAD = n_alt + 1;
-            const char *gt = nullptr;
-            if (iGT_ >= 0 && iGT_ < entry_fields_.size()) {
-                gt = entry_fields_[iGT_];
-            }
-            const char *dp = nullptr;
-            if (iDP_ >= 0 && iDP_ < entry_fields_.size()) {
-                dp = entry_fields_[iDP_];
-            }
-            if (gt && dp &&
-                (strcmp(gt, "0/0") || strcmp(gt, "0|0") || strcmp(gt, "./.") ||
-                 strcmp(gt, ".|."))) {
-                format_buffer_ << dp << ",0";
-            } else {
-                format_buffer_ << ".,.";
-            }
-        } else if (i == iPL_ && (!present || !strcmp(field, "."))) {
-            // const int nPL = (n_alt + 1) * (n_alt + 2) / 2;
-            format_buffer_ << ".,.,.";
-        } else {
-            format_buffer_ << (present ? field : ".");
+// The number of dense columns N: the number of columns on the first line (or in the header, if
+// selecting samples)
+uint64_t DecoderImpl::columns(const vector<char *> &tokens) {
+    if (!N_) {
+        if (!samples_.empty()) {
+            fail("--samples requires the #CHROM header line");
         }
+        N_ = tokens.size() - 9;
+        reset_row();
+        stats_.N = N_;
     }
-    ans = format_buffer_.Get();
+    return N_;
 }
 
-unique_ptr<Transcoder> NewDecoder(bool with_missing_fields) {
-    return make_unique<DecoderImpl>(with_missing_fields);
+void DecoderImpl::select_samples(char *header_line) {
+    N_ = SelectSamples(header_line, samples_, selected_, buffer_);
+    reset_row();
+    stats_.N = N_;
 }
 
-class TabixIterator {
-    htsFile *fp_;
-    tbx_t *tbx_;
-
-    hts_itr_t *it_;
-    kstring_t str_ = {0, 0, 0};
-    bool valid_ = false;
-
-    TabixIterator(htsFile *fp, tbx_t *tbx, hts_itr_t *it) {
-        fp_ = fp;
-        tbx_ = tbx;
-        it_ = it;
-        assert(tbx_ && fp_ && it_);
+// Forget the remembered cells of all columns
+void DecoderImpl::reset_row() {
+    const uint64_t M = samples_.empty() ? N_ : selected_.size();
+    row_offsets_.assign(M + 1, 0);
+    next_offsets_.assign(M + 1, 0);
+    row_incomplete_ = true;
+    skipped_.clear();
+    skipped_text_.Clear();
+    if (with_missing_fields_) {
+        raw_offsets_.assign(M + 1, 0);
+        raw_next_offsets_.assign(M + 1, 0);
+        row_layout_ = nullptr;
     }
+}
 
-  public:
-    ~TabixIterator() {
-        tbx_itr_destroy(it_);
-        if (str_.s) {
-            free(str_.s);
-        }
+// Look up (or prepare) the MissingFields for the line's FORMAT & n_alt (--with-missing-fields).
+// Fields declared with Number=A, R or G are padded to their vector lengths; absent a
+// declaration, we treat AD as R and PL as G (which suffices for our practical need).
+void DecoderImpl::update_missing_fields(const char *format, int n_alt) {
+    if (layout_ && last_n_alt_ == n_alt && last_format_ == format) {
+        return;
     }
-
-    static unique_ptr<TabixIterator> Open(htsFile *fp, tbx_t *tbx, const char *region) {
-        if (!tbx) {
-            return nullptr;
+    last_format_ = format;
+    last_n_alt_ = n_alt;
+    auto &cached = missing_fields_cache_[last_format_ + '/' + to_string(n_alt)];
+    if (!cached) {
+        cached = make_unique<MissingFields>();
+        cached->n_alt = n_alt;
+        for (int i = 0; i < n_alt; i++) {
+            cached->AD_zeros += ",0";
         }
-        hts_itr_t *it = tbx_itr_querys(tbx, region);
-        if (!it) {
-            return nullptr;
+        string format_copy = last_format_;
+        vector<char *> fields;
+        split(format_copy, ':', back_inserter(fields));
+        for (int i = 0; i < fields.size(); i++) {
+            const char *field = fields[i];
+            auto declared = format_numbers_.find(field);
+            char number = 0;
+            if (declared != format_numbers_.end()) {
+                number = declared->second;
+            } else if (!strcmp(field, "AD")) {
+                number = 'R';
+            } else if (!strcmp(field, "PL")) {
+                number = 'G';
+            }
+            if (!strcmp(field, "DP")) {
+                cached->iDP = i;
+            } else if (!strcmp(field, "AD")) {
+                cached->iAD = i;
+            }
+            cached->number.push_back(number);
         }
-        auto ans = unique_ptr<TabixIterator>(new TabixIterator(fp, tbx, it));
-        ans->Next();
-        return ans;
     }
+    layout_ = cached.get();
+}
 
-    bool Valid() const { return valid_ && str_.s; }
-
-    const char *Line() const {
-        if (Valid()) {
-            assert(ks_len((kstring_t *)&str_) == strlen(str_.s));
-            return str_.s;
-        }
-        return nullptr;
+// The fill template of the current layout for genotypes of the given ploidy
+const DecoderImpl::MissingFields::Template &DecoderImpl::missing_fields_template(size_t ploidy) {
+    auto &templates = layout_->templates;
+    if (templates.size() <= ploidy) {
+        templates.resize(ploidy + 1);
     }
-
-    void Next() {
-        valid_ = (tbx_itr_next(fp_, tbx_, it_, &str_) >= 0);
-        assert(!valid_ || str_.s);
+    auto &tmpl = templates[ploidy];
+    if (!tmpl) {
+        tmpl = make_unique<MissingFields::Template>();
+        const uint64_t n_alleles = layout_->n_alt + 1;
+        for (char number : layout_->number) {
+            uint64_t n = 1;
+            if (number == 'A') {
+                n = layout_->n_alt;
+            } else if (number == 'R') {
+                n = n_alleles;
+            } else if (number == 'G') {
+                // genotypes of the given ploidy: (n_alleles + ploidy - 1) choose ploidy
+                for (uint64_t i = 1; i <= ploidy; i++) {
+                    n = n * (n_alleles + i - 1) / i;
+                }
+            }
+            string fill = ".";
+            for (uint64_t i = 1; i < n; i++) {
+                fill += ",.";
+            }
+            tmpl->fills.push_back(fill);
+        }
+        const size_t n_fields = tmpl->fills.size();
+        tmpl->suffixes.assign(n_fields + 1, string());
+        tmpl->AD_pos.assign(n_fields + 1, string::npos);
+        for (size_t k = n_fields; k-- > 0;) {
+            tmpl->suffixes[k] = ":" + tmpl->fills[k] + tmpl->suffixes[k + 1];
+            if (k == layout_->iAD) {
+                tmpl->AD_pos[k] = 1;
+            } else if (tmpl->AD_pos[k + 1] != string::npos) {
+                tmpl->AD_pos[k] = tmpl->AD_pos[k + 1] + 1 + tmpl->fills[k].size();
+            }
+        }
     }
-};
+    return *tmpl;
+}
 
-void TabixSlice(const std::string &spvcf_gz, std::vector<std::string> regions, std::ostream &out) {
-    // Open the file
-    auto fp = shared_ptr<htsFile>(hts_open(spvcf_gz.c_str(), "r"), [](htsFile *f) {
-        if (f && hts_close(f))
-            throw runtime_error("hts_close");
-    });
-    if (!fp) {
-        throw runtime_error("Failed to open " + spvcf_gz);
+// Append entry (of length len) to buffer_ with trailing missing fields added, and missing vector
+// fields padded with . to the correct length, according to the current layout_
+// (--with-missing-fields). For non-variant genotypes we also fill AD={DP},0,... if it'd otherwise
+// be missing.
+void DecoderImpl::add_missing_fields(const char *entry, size_t len) {
+    const char *end = entry + len;
+    const char *GT_end = (const char *)memchr(entry, ':', len);
+    GT_end = GT_end ? GT_end : end;
+
+    // GT ploidy & whether it's non-variant (all 0 or all .)
+    size_t ploidy = 1;
+    bool zero = false, dot = false, other = false;
+    for (const char *c = entry; c < GT_end; c++) {
+        switch (*c) {
+        case '0':
+            zero = true;
+            break;
+        case '.':
+            dot = true;
+            break;
+        case '/':
+        case '|':
+            ++ploidy;
+            break;
+        default:
+            other = true;
+        }
     }
-
-    // Open the index file
-    auto tbx = shared_ptr<tbx_t>(tbx_index_load(spvcf_gz.c_str()), [](tbx_t *t) {
-        if (t)
-            tbx_destroy(t);
-    });
-    if (!tbx) {
-        throw runtime_error("Falied to open .tbi/.csi index of " + spvcf_gz);
+    const auto &tmpl = missing_fields_template(ploidy);
+
+    // DP, if we'd need it to fill AD
+    const char *DP = nullptr;
+    size_t DP_len = 0;
+    if (!other && zero != dot && layout_->iAD >= 0 && layout_->iDP >= 0) {
+        const char *field = entry;
+        for (int i = 0; i < layout_->iDP && field; i++) {
+            field = (const char *)memchr(field, ':', end - field);
+            field = field ? field + 1 : nullptr;
+        }
+        if (field) {
+            const char *field_end = (const char *)memchr(field, ':', end - field);
+            DP_len = (field_end ? field_end : end) - field;
+            DP = (DP_len && strncmp(field, ".", DP_len)) ? field : nullptr;
+        }
     }
-
-    // Copy the header lines
-    kstring_t str = {0, 0, 0};
-    while (hts_getline(fp.get(), KS_SEP_LINE, &str) >= 0) {
-        if (!str.l || str.s[0] != tbx->conf.meta_char) {
-            break;
+    auto add_AD_fill = [&](size_t i) {
+        if (DP) {
+            buffer_.Add(DP, DP_len);
+            buffer_ << layout_->AD_zeros;
+        } else {
+            buffer_ << tmpl.fills[i];
         }
-        out << str.s << '\n';
+    };
+
+    // copy the fields present, filling those that are just .
+    const size_t n_fields = tmpl.fills.size();
+    size_t i = 0;
+    for (const char *field = entry; field; i++) {
+        const char *field_end = (const char *)memchr(field, ':', end - field);
+        const size_t field_len = (field_end ? field_end : end) - field;
+        if (i) {
+            buffer_ << ':';
+        }
+        const bool missing = i < n_fields && field_len == 1 && *field == '.';
+        if (missing && i == layout_->iAD) {
+            add_AD_fill(i);
+        } else if (missing) {
+            buffer_ << tmpl.fills[i];
+        } else {
+            buffer_.Add(field, field_len);
+        }
+        field = field_end ? field_end + 1 : nullptr;
     }
 
-    for (const auto &region : regions) {
-        // Parse the region as either 'chrom' or 'chrom:lo-hi'
-        string region_chrom, region_hi;
-        uint64_t region_lo = ULLONG_MAX;
-        auto c = region.find(':');
-        if (c == string::npos) {
-            region_chrom = region;
+    // then the missing trailing fields
+    if (i < n_fields) {
+        const string &suffix = tmpl.suffixes[i];
+        const size_t AD_pos = tmpl.AD_pos[i];
+        if (DP && AD_pos != string::npos) {
+            buffer_.Add(suffix.data(), AD_pos);
+            add_AD_fill(layout_->iAD);
+            const size_t rest = AD_pos + tmpl.fills[layout_->iAD].size();
+            buffer_.Add(suffix.data() + rest, suffix.size() - rest);
         } else {
-            region_chrom = region.substr(0, c);
-            auto d = region.find('-', c);
-            if (c == 0 || d == string::npos || d <= c + 1 || d >= region.size() - 1) {
-                throw runtime_error("invalid region " + region);
-            }
-            errno = 0;
-            region_lo = strtoull(region.substr(c + 1, d - c - 1).c_str(), nullptr, 10);
-            if (errno) {
-                throw runtime_error("invalid region lo " + region);
-            }
-            region_hi = region.substr(d + 1);
-            assert(region_hi.size());
+            buffer_ << suffix;
         }
-        assert(region_chrom.size());
+    }
+}
 
-        // Read the first line in this region
-        auto itr = TabixIterator::Open(fp.get(), tbx.get(), region.c_str());
-        if (!itr || !itr->Valid()) {
-            continue;
-        }
+unique_ptr<Transcoder> NewDecoder(bool with_missing_fields, const vector<string> &samples) {
+    return make_unique<DecoderImpl>(with_missing_fields, samples);
+}
 
-        // extract INFO spVCF_checkpointPOS=ck.
-        vector<char *> tokens;
-        string linecpy(itr->Line());
-        split(linecpy, '\t', back_inserter(tokens), 9);
-        if (tokens.size() < 10) {
-            throw runtime_error("read line with fewer than 10 columns");
+// BCF output: like DecoderImpl, we remember the last dense cell of each (selected) column, but
+// also keep it parsed into the BCF values of its FORMAT fields. Each row then costs only the
+// parsing of its dense cells, plus copying the remembered values into the new record.
+class BCFDecoderImpl : public TranscoderBase<BCFDecoder> {
+  public:
+    BCFDecoderImpl(const string &filename, const vector<string> &samples, hts_tpool *pool)
+        : samples_(samples) {
+        fp_ = hts_open(filename.c_str(), "wb");
+        if (!fp_) {
+            throw runtime_error("spvcf: failed to open BCF output file " + filename);
         }
-        string INFO = tokens[7];
-        if (INFO.substr(0, 20) != "spVCF_checkpointPOS=") {
-            // This first line happens to be a checkpoint, so we can just copy
-            // all the encoded spVCF. This occurs when slicing a whole
-            // chromosome since the first line for each chromosome is a
-            // checkpoint, but it can also happen fortuitously in the middle.
-            for (; itr->Valid(); itr->Next()) {
-                out << itr->Line() << '\n';
+        if (pool) {
+            htsThreadPool tp = {pool, 0};
+            if (hts_set_thread_pool(fp_, &tp) != 0) {
+                throw runtime_error("spvcf: failed to set up BGZF thread pool");
             }
-            continue;
         }
-        if (region_lo == ULLONG_MAX) {
-            throw runtime_error("First line for chromosome was not a checkpoint: " + region);
+        rec_ = bcf_init();
+        if (!rec_) {
+            throw bad_alloc();
         }
-        errno = 0;
-        uint64_t ck = strtoull(INFO.substr(20, INFO.find(';')).c_str(), nullptr, 10);
-        if (errno || ck >= region_lo) {
-            throw runtime_error("invalid spVCF_checkpointPOS field");
+    }
+    BCFDecoderImpl(const BCFDecoderImpl &) = delete;
+    ~BCFDecoderImpl() {
+        bcf_destroy(rec_);
+        if (hdr_) {
+            bcf_hdr_destroy(hdr_);
         }
-
-        // Reopen iterator on chrom:ck-hi
-        assert(region_hi.size());
-        string ck_region = region_chrom + ":" + to_string(ck) + "-" + region_hi;
-        itr = TabixIterator::Open(fp.get(), tbx.get(), ck_region.c_str());
-        if (!itr || !itr->Valid()) {
-            throw runtime_error("couldn't open checkpoint region " + ck_region + " before " +
-                                region);
+        if (fp_) {
+            hts_close(fp_);
         }
+        free(line_.s);
+    }
+    void ProcessLine(char *input_line) override;
+    void Close() override;
 
-        // Find the first checkpoint in this expanded region (it's not
-        // guaranteed to be the very first result in all cases)
-        uint64_t linepos = ULLONG_MAX;
-        while (true) {
-            linecpy = itr->Line();
-            tokens.clear();
-            split(linecpy, '\t', back_inserter(tokens), 9);
-            if (tokens.size() < 10) {
-                throw runtime_error("read line with fewer than 10 columns");
-            }
-            errno = 0;
-            linepos = strtoull(tokens[1], nullptr, 10);
-            if (errno) {
-                throw runtime_error("invalid POS " + string(tokens[1]) +
-                                    " while looking for checkpoint in " + ck_region);
-            }
-            if (string(tokens[7]).substr(0, 20) != "spVCF_checkpointPOS=") {
-                break;
-            }
-            itr->Next();
-            // We're expecting to find the checkpoint before region_lo
-            if (!itr->Valid() || linepos >= region_lo) {
-                throw runtime_error("couldn't find checkpoint in " + ck_region + " before " +
-                                    region);
-            }
-        }
+  private:
+    // a FORMAT field, with its type declared in the header
+    struct Field {
+        string key;
+        int type = BCF_HT_STR; // BCF_HT_INT, BCF_HT_REAL or BCF_HT_STR
+        bool GT = false;
+    };
+    // A column's last dense cell, and its values for each FORMAT field: packed int32_t (for GT &
+    // Integer fields), float (Float) or NUL-terminated char (String), according to the field type
+    struct Cell {
+        string text;
+        const vector<Field> *format = nullptr; // the FORMAT the values were parsed for, if any
+        string values;
+        vector<uint32_t> ends; // end offset of each field's values
+    };
+
+    void write_header(char *header_line);
+    const vector<Field> &format_fields(const char *format);
+    void parse_cell(Cell &cell, const vector<Field> &fields);
+    void parse_GT(const char *p, const char *end, string &values);
+    void parse_numbers(const char *p, const char *end, int type, string &values);
+
+    htsFile *fp_ = nullptr;
+    bcf_hdr_t *hdr_ = nullptr;
+    bcf1_t *rec_ = nullptr;
+    OStringStream header_; // header text until the #CHROM line
+    kstring_t line_ = {0, 0, nullptr};
+
+    vector<string> samples_;
+    vector<uint64_t> selected_; // all columns, if samples_ is empty
+    uint64_t N_ = 0;
+    vector<Cell> cells_; // for each of the selected_ columns
+
+    // FORMAT fields cache, by FORMAT
+    unordered_map<string, vector<Field>> formats_;
+    string last_format_;
+    const vector<Field> *fields_ = nullptr;
 
-        // From the checkpoint, run spVCF decoder until we see a line with POS >= region_lo
-        // TODO: the correct condition may be END >= region_lo. Needs careful testing.
-        auto decoder = NewDecoder(false);
-        while (true) {
-            linecpy = itr->Line();
+    // temp buffers used in ProcessLine (to reduce allocations)
+    vector<char *> tokens_;
+    vector<int32_t> values_;
+    vector<const char *> strings_;
+};
 
-            string decoded_line = decoder->ProcessLine(&linecpy[0]);
-            linecpy = decoded_line;
-            tokens.clear();
-            split(linecpy, '\t', back_inserter(tokens), 9);
-            if (tokens.size() < 10) {
-                throw runtime_error("read line with fewer than 10 columns");
-            }
+void BCFDecoderImpl::ProcessLine(char *input_line) {
+    ++line_number_;
+    if (*input_line == 0 || *input_line == '#') {
+        if (hdr_) {
+            fail("header line following #CHROM line");
+        }
+        if (strncmp(input_line, "##fileformat=spVCF", 18) == 0 && strchr(input_line, ';')) {
+            header_ << "##fileformat=" << (strchr(input_line, ';') + 1) << '\n';
+        } else if (strncmp(input_line, "#CHROM\t", 7) == 0) {
+            write_header(input_line);
+        } else if (*input_line) {
+            header_ << input_line << '\n';
+        }
+        return;
+    }
+    if (!hdr_) {
+        fail("BCF output requires the #CHROM header line");
+    }
+    ++stats_.lines;
+
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    if (tokens_.size() < 10) {
+        fail("Invalid project VCF: fewer than 10 columns");
+    }
+
+    // Update the remembered cells of the selected columns from the dense cells, leaving them to
+    // be parsed below
+    uint64_t k = 0;
+    auto update = [&](uint64_t lo, uint64_t hi, const char *t) {
+        if (t) {
+            if (k < selected_.size() && selected_[k] == lo) {
+                Cell &cell = cells_[k++];
+                cell.text = t;
+                cell.format = nullptr;
+            }
+            return;
+        }
+        for (; k < selected_.size() && selected_[k] < hi; k++) {
+            if (cells_[k].text.empty()) {
+                fail("Missing preceding dense cells");
+            }
+        }
+    };
+    for_sparse_cells(tokens_, N_, [this](const string &msg) { fail(msg); }, update);
+
+    // Let htslib parse the first eight columns (stripping spVCF_checkpointPOS from INFO)
+    if (bcf_hdr_name2id(hdr_, tokens_[0]) < 0) {
+        fail(string("CHROM ") + tokens_[0] + " isn't declared (##contig) in the header");
+    }
+    line_.l = 0;
+    for (int i = 0; i < 8; i++) {
+        const char *t = tokens_[i];
+        if (i == 7 && strncmp(t, "spVCF_checkpointPOS=", 20) == 0) {
+            t = strchr(t, ';');
+            t = t ? t + 1 : ".";
+        }
+        if ((i && kputc('\t', &line_) < 0) || kputs(t, &line_) < 0) {
+            throw bad_alloc();
+        }
+    }
+    if (vcf_parse(&line_, hdr_, rec_) != 0) {
+        fail("htslib failed to parse the line");
+    }
+    rec_->n_sample = selected_.size();
+
+    // Add each FORMAT field's values from the remembered cells (parsing any new ones)
+    const vector<Field> &fields = format_fields(tokens_[8]);
+    const size_t n = selected_.size();
+    for (auto &cell : cells_) {
+        if (cell.format != &fields) {
+            parse_cell(cell, fields);
+        }
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+        const Field &field = fields[i];
+        if (field.type == BCF_HT_STR && !field.GT) {
+            strings_.resize(n);
+            for (size_t s = 0; s < n; s++) {
+                const Cell &cell = cells_[s];
+                const uint32_t begin = i ? cell.ends[i - 1] : 0;
+                strings_[s] = begin < cell.ends[i] ? cell.values.data() + begin : ".";
+            }
+            if (bcf_update_format_string(hdr_, rec_, field.key.c_str(), strings_.data(), n)) {
+                fail("htslib failed to set FORMAT field " + field.key);
+            }
+            continue;
+        }
+        // pad each cell's values to the greatest number of them; as htslib parses VCF text, an
+        // omitted field becomes one missing value followed by padding
+        size_t m = 1;
+        for (const auto &cell : cells_) {
+            const uint32_t begin = i ? cell.ends[i - 1] : 0;
+            m = max(m, size_t(cell.ends[i] - begin) / sizeof(int32_t));
+        }
+        const int32_t vector_end =
+            field.type == BCF_HT_REAL ? bcf_float_vector_end : bcf_int32_vector_end;
+        const int32_t missing = field.type == BCF_HT_REAL ? bcf_float_missing : bcf_int32_missing;
+        values_.assign(n * m, vector_end);
+        for (size_t s = 0; s < n; s++) {
+            const Cell &cell = cells_[s];
+            const uint32_t begin = i ? cell.ends[i - 1] : 0;
+            if (begin == cell.ends[i]) {
+                values_[s * m] = missing;
+            } else {
+                memcpy(&values_[s * m], cell.values.data() + begin, cell.ends[i] - begin);
+            }
+        }
+        if (bcf_update_format(hdr_, rec_, field.key.c_str(), values_.data(), n * m,
+                              field.GT ? BCF_HT_INT : field.type)) {
+            fail("htslib failed to set FORMAT field " + field.key);
+        }
+    }
+
+    if (bcf_write(fp_, hdr_, rec_) != 0) {
+        throw runtime_error("spvcf: failed writing BCF output");
+    }
+
+    count_sparse_row(stats_, tokens_.size() - 9, N_);
+}
+
+void BCFDecoderImpl::write_header(char *header_line) {
+    if (samples_.empty()) {
+        header_ << header_line;
+        vector<char *> tokens;
+        split(header_line, '\t', back_inserter(tokens));
+        if (tokens.size() < 10) {
+            fail("Invalid #CHROM header line: fewer than 10 columns");
+        }
+        N_ = tokens.size() - 9;
+        selected_.resize(N_);
+        for (uint64_t s = 0; s < N_; s++) {
+            selected_[s] = s;
+        }
+    } else {
+        N_ = SelectSamples(header_line, samples_, selected_, header_);
+    }
+    stats_.N = N_;
+    cells_.assign(selected_.size(), Cell());
+
+    hdr_ = bcf_hdr_init("r"); // (without the default lines, which the text has already)
+    if (!hdr_) {
+        throw bad_alloc();
+    }
+    string text = header_.Get();
+    if (bcf_hdr_parse(hdr_, &text[0]) != 0) {
+        fail("htslib failed to parse the header");
+    }
+    if (bcf_hdr_write(fp_, hdr_) != 0) {
+        throw runtime_error("spvcf: failed writing BCF output");
+    }
+}
+
+const vector<BCFDecoderImpl::Field> &BCFDecoderImpl::format_fields(const char *format) {
+    if (fields_ && last_format_ == format) {
+        return *fields_;
+    }
+    auto p = formats_.find(format);
+    if (p == formats_.end()) {
+        string format_copy = format;
+        vector<char *> keys;
+        split(format_copy, ':', back_inserter(keys));
+        vector<Field> fields;
+        for (const char *key : keys) {
+            Field field;
+            field.key = key;
+            field.GT = field.key == "GT";
+            const int id = bcf_hdr_id2int(hdr_, BCF_DT_ID, key);
+            if (id < 0 || !bcf_hdr_idinfo_exists(hdr_, BCF_HL_FMT, id)) {
+                fail("FORMAT field " + field.key + " isn't declared in the header");
+            }
+            field.type = bcf_hdr_id2type(hdr_, BCF_HL_FMT, id);
+            if (!field.GT && field.type != BCF_HT_INT && field.type != BCF_HT_REAL &&
+                field.type != BCF_HT_STR) {
+                fail("FORMAT field " + field.key + " has unsupported type");
+            }
+            fields.push_back(field);
+        }
+        p = formats_.emplace(format, move(fields)).first;
+    }
+    last_format_ = format;
+    fields_ = &p->second;
+    return *fields_;
+}
+
+// Parse the cell's text into the values of each field (trailing fields may be omitted)
+void BCFDecoderImpl::parse_cell(Cell &cell, const vector<Field> &fields) {
+    cell.values.clear();
+    cell.ends.clear();
+    const char *p = cell.text.c_str();
+    for (const Field &field : fields) {
+        const char *end = strchr(p, ':');
+        if (!end) {
+            end = p + strlen(p);
+        }
+        if (p < end) {
+            if (field.GT) {
+                parse_GT(p, end, cell.values);
+            } else if (field.type == BCF_HT_STR) {
+                cell.values.append(p, end - p);
+                cell.values += '\0';
+            } else {
+                parse_numbers(p, end, field.type, cell.values);
+            }
+        }
+        cell.ends.push_back(cell.values.size());
+        p = *end ? end + 1 : end;
+    }
+    cell.format = &fields;
+}
+
+void BCFDecoderImpl::parse_GT(const char *p, const char *end, string &values) {
+    int32_t phased = 0;
+    for (;;) {
+        int32_t allele;
+        if (*p == '.') {
+            allele = bcf_gt_missing | phased;
+            ++p;
+        } else {
+            char *q;
+            errno = 0;
+            long idx = strtol(p, &q, 10);
+            if (errno || q == p || idx < 0 || idx > INT32_MAX / 2 - 1) {
+                fail("Invalid GT");
+            }
+            allele = bcf_gt_unphased(int32_t(idx)) | phased;
+            p = q;
+        }
+        values.append((const char *)&allele, sizeof(allele));
+        if (p == end) {
+            break;
+        }
+        if (*p != '/' && *p != '|') {
+            fail("Invalid GT");
+        }
+        phased = *p++ == '|';
+    }
+}
+
+// Parse comma-separated Integer or Float values
+void BCFDecoderImpl::parse_numbers(const char *p, const char *end, int type, string &values) {
+    for (;;) {
+        int32_t value;
+        char *q;
+        if (*p == '.' && (p + 1 == end || p[1] == ',')) {
+            value = type == BCF_HT_REAL ? bcf_float_missing : bcf_int32_missing;
+            q = (char *)p + 1;
+        } else if (type == BCF_HT_REAL) {
+            errno = 0;
+            float f = strtof(p, &q);
+            if (errno || q == p) {
+                fail("Invalid Float value");
+            }
+            memcpy(&value, &f, sizeof(value));
+        } else {
+            errno = 0;
+            long x = strtol(p, &q, 10);
+            // (htslib reserves the least few values)
+            if (errno || q == p || x < INT32_MIN + 8 || x > INT32_MAX) {
+                fail("Invalid Integer value");
+            }
+            value = int32_t(x);
+        }
+        values.append((const char *)&value, sizeof(value));
+        p = q;
+        if (p == end) {
+            break;
+        }
+        if (*p++ != ',') {
+            fail("Invalid number");
+        }
+    }
+}
+
+void BCFDecoderImpl::Close() {
+    if (!hdr_) {
+        throw runtime_error("spvcf: BCF output requires the #CHROM header line");
+    }
+    htsFile *fp = fp_;
+    fp_ = nullptr;
+    if (hts_close(fp) != 0) {
+        throw runtime_error("spvcf: failed writing BCF output");
+    }
+}
+
+unique_ptr<BCFDecoder> NewBCFDecoder(const string &filename, const vector<string> &samples,
+                                     hts_tpool *pool) {
+    return make_unique<BCFDecoderImpl>(filename, samples, pool);
+}
+
+// Sample subsetting in the sparse domain: each kept column is either dense on a given line, in
+// which case it's copied as-is, or covered by a run of quotes, in which case it's still quoted
+// since its last dense entry is kept too. So the output needs only the runs of quotes re-counted
+// over the kept columns, without keeping any column state. Checkpoints remain checkpoints.
+class SubsetImpl : public TranscoderBase<> {
+  public:
+    SubsetImpl(const vector<string> &samples) : samples_(samples) {}
+    SubsetImpl(const SubsetImpl &) = delete;
+    const char *ProcessLine(char *input_line) override;
+    size_t OutputLength() const override { return buffer_.Size(); }
+    void Restart() override {}
+
+  private:
+    vector<string> samples_;
+    vector<uint64_t> selected_;
+    uint64_t N_ = 0;
+    vector<char *> tokens_;
+    OStringStream buffer_;
+};
+
+const char *SubsetImpl::ProcessLine(char *input_line) {
+    ++line_number_;
+    buffer_.Clear();
+    // Pass through header lines, except for the subset of the #CHROM line
+    if (*input_line == 0 || *input_line == '#') {
+        if (strncmp(input_line, "#CHROM\t", 7) == 0) {
+            N_ = SelectSamples(input_line, samples_, selected_, buffer_);
+            stats_.N = selected_.size();
+        } else {
+            buffer_ << input_line;
+        }
+        return buffer_.Get();
+    }
+    if (!N_) {
+        fail("subset requires the #CHROM header line");
+    }
+    ++stats_.lines;
+
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    if (tokens_.size() < 10) {
+        fail("Invalid spVCF: fewer than 10 columns");
+    }
+    if (strncmp(tokens_[7], "spVCF_checkpointPOS=", 20) != 0) {
+        ++stats_.checkpoints;
+    }
+    buffer_ << tokens_[0];
+    for (int i = 1; i < 9; i++) {
+        buffer_ << '\t' << tokens_[i];
+    }
+
+    uint64_t k = 0, quote_run = 0, sparse_cells = 0;
+    auto flush_quotes = [&]() {
+        if (quote_run) {
+            buffer_.Add("\t\"", 2);
+            if (quote_run > 1) {
+                buffer_.Add(quote_run);
+            }
+            ++sparse_cells;
+            quote_run = 0;
+        }
+    };
+    // Walk all the cells, even beyond the last selected column, to check the number of columns
+    // they imply
+    auto subset = [&](uint64_t lo, uint64_t hi, const char *cell) {
+        if (!cell) {
+            while (k < selected_.size() && selected_[k] < hi) {
+                ++quote_run;
+                ++k;
+            }
+        } else if (k < selected_.size() && selected_[k] == lo) {
+            flush_quotes();
+            buffer_ << '\t' << cell;
+            ++sparse_cells;
+            ++k;
+        }
+    };
+    for_sparse_cells(tokens_, N_, [this](const string &msg) { fail(msg); }, subset);
+    flush_quotes();
+
+    count_sparse_row(stats_, sparse_cells, selected_.size());
+    return buffer_.Get();
+}
+
+unique_ptr<Transcoder> NewSubsetter(const vector<string> &samples) {
+    return make_unique<SubsetImpl>(samples);
+}
+
+// The INFO fields we compute (replacing any in the input)
+static const vector<pair<string, string>> site_stats_info = {
+    {"AC", "Number=A,Type=Integer,Description=\"Allele count in genotypes, for each ALT allele\""},
+    {"AN", "Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\""},
+    {"AF", "Number=A,Type=Float,Description=\"Allele frequency, for each ALT allele\""},
+    {"NS", "Number=1,Type=Integer,Description=\"Number of samples with fully called genotypes\""},
+    {"F_MISSING",
+     "Number=1,Type=Float,Description=\"Fraction of samples with missing genotype calls\""},
+    {"N_HET", "Number=1,Type=Integer,Description=\"Number of heterozygous genotypes\""},
+    {"N_HOMALT", "Number=1,Type=Integer,Description=\"Number of homozygous ALT genotypes\""}};
+
+// Site statistics computed from the sparse encoding: running totals over the genotypes of all N
+// columns are kept up to date by each row's explicit cells (subtracting the contribution of the
+// column's previous genotype and adding the new one). Quoted cells repeat their columns' previous
+// cells, so they leave the totals as they were, and each row costs time proportional to its
+// explicit cells rather than N.
+class SiteStatsImpl : public TranscoderBase<> {
+  public:
+    SiteStatsImpl() {
+        for (const auto &info : site_stats_info) {
+            info_pending_.push_back(info.first);
+        }
+    }
+    SiteStatsImpl(const SiteStatsImpl &) = delete;
+    const char *ProcessLine(char *input_line) override;
+    size_t OutputLength() const override { return buffer_.Size(); }
+    void Restart() override {
+        for (auto &g : genotypes_) {
+            g = Genotype();
+        }
+        totals_ = Totals();
+        restarted_ = true;
+    }
+
+  private:
+    // the GT of a column's last explicit cell: allele indices, or -1 if missing (ploidy <= 2)
+    struct Genotype {
+        int32_t alleles[2] = {-1, -1};
+        uint8_t ploidy = 0; // 0 if no cell yet
+    };
+    struct Totals {
+        vector<int64_t> AC; // by allele index, including REF
+        int64_t AN = 0, NS = 0, missing = 0, het = 0, homalt = 0;
+    };
+
+    void header_line(char *input_line);
+    void columns(uint64_t N);
+    Genotype parse_GT(const char *cell);
+    void add(const Genotype &g, int64_t sign);
+    void write_info(const char *INFO, int n_alt);
+
+    uint64_t N_ = 0;
+    vector<Genotype> genotypes_;
+    Totals totals_;
+    bool restarted_ = true; // the next data line must be a checkpoint
+    vector<string> info_pending_; // our INFO header lines not yet written
+    vector<char *> tokens_;
+    OStringStream buffer_;
+};
+
+const char *SiteStatsImpl::ProcessLine(char *input_line) {
+    ++line_number_;
+    buffer_.Clear();
+    if (*input_line == 0 || *input_line == '#') {
+        header_line(input_line);
+        return buffer_.Get();
+    }
+    ++stats_.lines;
+
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    if (tokens_.size() < 10) {
+        fail("Invalid spVCF: fewer than 10 columns");
+    }
+    if (strncmp(tokens_[7], "spVCF_checkpointPOS=", 20) != 0) {
+        restarted_ = false;
+    } else if (restarted_) {
+        fail("Missing preceding dense cells (spVCF must begin with a checkpoint)");
+    }
+    if (!N_) {
+        columns(tokens_.size() - 9);
+    }
+
+    // update the totals with the explicit cells
+    auto update = [&](uint64_t lo, uint64_t, const char *cell) {
+        if (cell) {
+            Genotype g = parse_GT(cell);
+            add(genotypes_[lo], -1);
+            add(g, 1);
+            genotypes_[lo] = g;
+        }
+    };
+    for_sparse_cells(tokens_, N_, [this](const string &msg) { fail(msg); }, update);
+
+    // CHROM through FILTER, and the INFO with our fields
+    int n_alt = 0;
+    if (strcmp(tokens_[4], ".") != 0) {
+        n_alt = 1;
+        for (const char *alt = tokens_[4]; *alt; alt++) {
+            n_alt += *alt == ',';
+        }
+    }
+    buffer_ << tokens_[0];
+    for (int i = 1; i < 7; i++) {
+        buffer_ << '\t' << tokens_[i];
+    }
+    buffer_ << '\t';
+    write_info(tokens_[7], n_alt);
+
+    count_sparse_row(stats_, tokens_.size() - 9, N_);
+    return buffer_.Get();
+}
+
+// Header: restore ##fileformat, replace any INFO header lines for the fields we compute (adding the
+// rest before the #CHROM line), and cut the #CHROM line down to the sites-only columns.
+void SiteStatsImpl::header_line(char *input_line) {
+    if (strncmp(input_line, "##fileformat=spVCF", 18) == 0 && strchr(input_line, ';')) {
+        buffer_ << "##fileformat=" << (strchr(input_line, ';') + 1);
+        return;
+    }
+    if (strncmp(input_line, "##INFO=<ID=", 11) == 0) {
+        const char *id = input_line + 11;
+        for (auto it = info_pending_.begin(); it != info_pending_.end(); ++it) {
+            if (strncmp(id, it->c_str(), it->size()) == 0 && id[it->size()] == ',') {
+                for (const auto &info : site_stats_info) {
+                    if (info.first == *it) {
+                        buffer_ << "##INFO=<ID=" << info.first << ',' << info.second << '>';
+                    }
+                }
+                info_pending_.erase(it);
+                return;
+            }
+        }
+    }
+    if (strncmp(input_line, "#CHROM\t", 7) != 0) {
+        buffer_ << input_line;
+        return;
+    }
+    for (const auto &info : site_stats_info) {
+        if (find(info_pending_.begin(), info_pending_.end(), info.first) != info_pending_.end()) {
+            buffer_ << "##INFO=<ID=" << info.first << ',' << info.second << ">\n";
+        }
+    }
+    info_pending_.clear();
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    if (tokens_.size() < 10) {
+        fail("Invalid #CHROM header line: fewer than 10 columns");
+    }
+    buffer_ << tokens_[0];
+    for (int i = 1; i < 8; i++) {
+        buffer_ << '\t' << tokens_[i];
+    }
+    columns(tokens_.size() - 9);
+}
+
+void SiteStatsImpl::columns(uint64_t N) {
+    N_ = N;
+    genotypes_.assign(N_, Genotype());
+    stats_.N = N_;
+}
+
+// Parse the GT (first field) of the cell
+SiteStatsImpl::Genotype SiteStatsImpl::parse_GT(const char *cell) {
+    Genotype g;
+    const char *p = cell;
+    while (true) {
+        if (g.ploidy == 2) {
+            fail("sitestats supports only haploid & diploid genotypes");
+        }
+        if (*p == '.') {
+            ++p;
+        } else if (*p >= '0' && *p <= '9') {
+            char *end = nullptr;
+            unsigned long a = strtoul(p, &end, 10);
+            if (a > 65535) {
+                fail("invalid GT");
+            }
+            g.alleles[g.ploidy] = int32_t(a);
+            p = end;
+        } else {
+            fail("invalid GT");
+        }
+        ++g.ploidy;
+        if (*p != '/' && *p != '|') {
+            break;
+        }
+        ++p;
+    }
+    if (*p && *p != ':') {
+        fail("invalid GT");
+    }
+    return g;
+}
+
+void SiteStatsImpl::add(const Genotype &g, int64_t sign) {
+    if (!g.ploidy) {
+        return;
+    }
+    bool called = true;
+    for (int i = 0; i < g.ploidy; i++) {
+        const int32_t a = g.alleles[i];
+        if (a < 0) {
+            called = false;
+            continue;
+        }
+        if (a >= totals_.AC.size()) {
+            totals_.AC.resize(a + 1, 0);
+        }
+        totals_.AC[a] += sign;
+        totals_.AN += sign;
+    }
+    if (!called) {
+        totals_.missing += sign;
+        return;
+    }
+    totals_.NS += sign;
+    if (g.ploidy == 2 && g.alleles[0] != g.alleles[1]) {
+        totals_.het += sign;
+    } else if (g.alleles[0] != 0) {
+        totals_.homalt += sign;
+    }
+}
+
+// The INFO column without spVCF_checkpointPOS and any of our fields, followed by our fields
+void SiteStatsImpl::write_info(const char *INFO, int n_alt) {
+    bool first = true;
+    if (strcmp(INFO, ".") != 0) {
+        string INFO_copy = INFO;
+        vector<char *> fields;
+        split(INFO_copy, ';', back_inserter(fields));
+        for (const char *field : fields) {
+            const size_t len = strcspn(field, "=");
+            bool ours = strncmp(field, "spVCF_checkpointPOS=", 20) == 0;
+            for (auto it = site_stats_info.begin(); !ours && it != site_stats_info.end(); ++it) {
+                ours = it->first.size() == len && strncmp(field, it->first.c_str(), len) == 0;
+            }
+            if (!ours && *field) {
+                buffer_ << (first ? "" : ";") << field;
+                first = false;
+            }
+        }
+    }
+    if (!first) {
+        buffer_ << ';';
+    }
+
+    auto count = [](int64_t x) { return uint64_t(max(x, int64_t(0))); };
+    auto fraction = [this](int64_t x, int64_t d) {
+        char s[32];
+        if (d > 0) {
+            snprintf(s, sizeof(s), "%g", double(x) / d);
+        } else {
+            strcpy(s, ".");
+        }
+        buffer_ << s;
+    };
+    auto AC = [this](int a) { return a < totals_.AC.size() ? totals_.AC[a] : int64_t(0); };
+    if (n_alt) {
+        buffer_ << "AC=";
+        for (int a = 1; a <= n_alt; a++) {
+            buffer_ << (a > 1 ? "," : "") << count(AC(a));
+        }
+        buffer_ << ';';
+    }
+    buffer_ << "AN=" << count(totals_.AN) << ';';
+    if (n_alt) {
+        buffer_ << "AF=";
+        for (int a = 1; a <= n_alt; a++) {
+            if (a > 1) {
+                buffer_ << ',';
+            }
+            fraction(AC(a), totals_.AN);
+        }
+        buffer_ << ';';
+    }
+    buffer_ << "NS=" << count(totals_.NS) << ";F_MISSING=";
+    fraction(totals_.missing, N_);
+    buffer_ << ";N_HET=" << count(totals_.het) << ";N_HOMALT=" << count(totals_.homalt);
+}
+
+unique_ptr<Transcoder> NewSiteStats() { return make_unique<SiteStatsImpl>(); }
+
+class SparseReaderImpl : public SparseReader {
+  public:
+    SparseReaderImpl(const string &filename) : input_(filename) {
+        // read the header lines, leaving the first row (if any) in line_
+        size_t len;
+        while ((line_ = input_.NextLine(len)) && (*line_ == 0 || *line_ == '#')) {
+            header_.emplace_back(line_, len);
+            ++line_number_;
+            if (strncmp(line_, "#CHROM\t", 7) == 0) {
+                vector<char *> tokens;
+                split(line_, '\t', back_inserter(tokens));
+                if (tokens.size() < 10) {
+                    fail("Invalid #CHROM header line: fewer than 10 columns");
+                }
+                samples_.assign(tokens.begin() + 9, tokens.end());
+            }
+        }
+        if (samples_.empty()) {
+            throw runtime_error("spvcf: input lacks the #CHROM header line");
+        }
+    }
+    const vector<string> &Header() const override { return header_; }
+    const vector<string> &Samples() const override { return samples_; }
+    const sparse_row *NextRow() override;
+
+  private:
+    void fail(const string &msg) {
+        ostringstream ss;
+        ss << "spvcf: " << msg << " (line " << line_number_ << ")";
+        throw runtime_error(ss.str());
+    }
+
+    LineReader input_;
+    char *line_ = nullptr; // next line to parse
+    uint64_t line_number_ = 0;
+    vector<string> header_, samples_;
+    sparse_row row_;
+    vector<char *> tokens_;
+};
+
+const sparse_row *SparseReaderImpl::NextRow() {
+    size_t len;
+    if (!line_ && !(line_ = input_.NextLine(len))) {
+        return nullptr;
+    }
+    ++line_number_;
+    tokens_.clear();
+    split(line_, '\t', back_inserter(tokens_));
+    line_ = nullptr;
+    if (tokens_.size() < 10) {
+        fail("Invalid spVCF: fewer than 10 columns");
+    }
+    copy(tokens_.begin(), tokens_.begin() + 9, row_.fields);
+
+    errno = 0;
+    row_.POS = strtoull(tokens_[1], nullptr, 10);
+    if (errno) {
+        fail("Couldn't parse POS");
+    }
+    char *INFO = tokens_[7];
+    row_.checkpoint = strncmp(INFO, "spVCF_checkpointPOS=", 20) != 0;
+    row_.checkpoint_pos = 0;
+    if (!row_.checkpoint) {
+        char *end = nullptr;
+        errno = 0;
+        row_.checkpoint_pos = strtoull(INFO + 20, &end, 10);
+        if (errno || (*end && *end != ';')) {
+            fail("Couldn't parse spVCF_checkpointPOS");
+        }
+        row_.fields[7] = (*end == ';') ? end + 1 : ".";
+    }
+
+    row_.cells.clear();
+    auto add = [&](uint64_t lo, uint64_t hi, const char *cell) {
+        if (!cell && row_.checkpoint) {
+            fail("Quoted cell in checkpoint row");
+        }
+        sparse_cell entry;
+        entry.lo = lo;
+        entry.hi = hi;
+        entry.cell = cell;
+        row_.cells.push_back(entry);
+    };
+    for_sparse_cells(tokens_, samples_.size(), [this](const string &msg) { fail(msg); }, add);
+    return &row_;
+}
+
+unique_ptr<SparseReader> NewSparseReader(const string &filename) {
+    return make_unique<SparseReaderImpl>(filename);
+}
+
+class TabixIterator {
+    htsFile *fp_;
+    tbx_t *tbx_;
+
+    hts_itr_t *it_;
+    kstring_t str_ = {0, 0, 0};
+    bool valid_ = false;
+
+    TabixIterator(htsFile *fp, tbx_t *tbx, hts_itr_t *it) {
+        fp_ = fp;
+        tbx_ = tbx;
+        it_ = it;
+        assert(tbx_ && fp_ && it_);
+    }
+
+  public:
+    ~TabixIterator() {
+        tbx_itr_destroy(it_);
+        if (str_.s) {
+            free(str_.s);
+        }
+    }
+
+    static unique_ptr<TabixIterator> Open(htsFile *fp, tbx_t *tbx, const char *region) {
+        if (!tbx) {
+            return nullptr;
+        }
+        hts_itr_t *it = tbx_itr_querys(tbx, region);
+        if (!it) {
+            return nullptr;
+        }
+        auto ans = unique_ptr<TabixIterator>(new TabixIterator(fp, tbx, it));
+        ans->Next();
+        return ans;
+    }
+
+    bool Valid() const { return valid_ && str_.s; }
+
+    const char *Line() const {
+        if (Valid()) {
+            assert(ks_len((kstring_t *)&str_) == strlen(str_.s));
+            return str_.s;
+        }
+        return nullptr;
+    }
+
+    void Next() {
+        valid_ = (tbx_itr_next(fp_, tbx_, it_, &str_) >= 0);
+        assert(!valid_ || str_.s);
+    }
+};
+
+// Iterates over the lines of a BGZF file from a virtual offset (a checkpoint located by the
+// sidecar index) through the last line on chrom with POS <= hi, which are the lines a tabix
+// iterator would give for the region beginning at the checkpoint.
+class CheckpointIterator {
+    BGZF *fp_;
+    string chrom_;
+    uint64_t hi_, pos_ = 0;
+    kstring_t str_ = {0, 0, 0};
+    bool valid_ = false;
+
+  public:
+    CheckpointIterator(htsFile *fp, uint64_t voffset, const string &chrom, uint64_t hi)
+        : fp_(hts_get_bgzfp(fp)), chrom_(chrom), hi_(hi) {
+        if (!fp_ || bgzf_seek(fp_, voffset, SEEK_SET) < 0) {
+            throw runtime_error("Failed to seek to checkpoint in " + chrom);
+        }
+        Next();
+    }
+    CheckpointIterator(const CheckpointIterator &) = delete;
+
+    ~CheckpointIterator() {
+        if (str_.s) {
+            free(str_.s);
+        }
+    }
 
+    bool Valid() const { return valid_; }
+
+    const char *Line() const { return valid_ ? str_.s : nullptr; }
+
+    uint64_t POS() const { return pos_; }
+
+    void Next() {
+        valid_ = false;
+        int ret = bgzf_getline(fp_, '\n', &str_);
+        if (ret < -1) {
+            throw runtime_error("I/O error reading or decompressing input");
+        }
+        if (ret >= 0 && strncmp(str_.s, chrom_.c_str(), chrom_.size()) == 0 &&
+            str_.s[chrom_.size()] == '\t') {
             errno = 0;
-            linepos = strtoull(tokens[1], nullptr, 10);
+            pos_ = strtoull(str_.s + chrom_.size() + 1, nullptr, 10);
             if (errno) {
-                throw runtime_error("invalid POS " + string(tokens[1]) +
-                                    " while looking for checkpoint in " + ck_region);
+                throw runtime_error("invalid POS in " + chrom_);
+            }
+            valid_ = pos_ <= hi_;
+        }
+    }
+};
+
+// The .ckpt sidecar written by spvcf encode --checkpoint-index (see FileWriter::IndexCheckpoints)
+class CheckpointIndex {
+  public:
+    struct Checkpoint {
+        uint64_t pos, voffset;
+        uint64_t prior_end; // greatest END of the preceding lines on the chromosome
+    };
+
+    // Load spvcf_gz.ckpt, or return nullptr if it's absent or was written for a different file
+    static unique_ptr<CheckpointIndex> Load(const string &spvcf_gz) {
+        const string filename = spvcf_gz + ".ckpt";
+        ifstream in(filename);
+        struct stat st;
+        string line;
+        if (!in || stat(spvcf_gz.c_str(), &st) != 0 || !getline(in, line) ||
+            line != "#spVCF_checkpoints\t" + to_string(st.st_size)) {
+            return nullptr;
+        }
+        auto ans = make_unique<CheckpointIndex>();
+        vector<char *> tokens;
+        while (getline(in, line)) {
+            tokens.clear();
+            split(line, '\t', back_inserter(tokens));
+            if (tokens.size() != 5) {
+                throw runtime_error("invalid checkpoint index " + filename);
+            }
+            Checkpoint ck;
+            char *end1 = nullptr, *end2 = nullptr, *end4 = nullptr;
+            ck.pos = strtoull(tokens[1], &end1, 10);
+            ck.voffset = strtoull(tokens[2], &end2, 10);
+            ck.prior_end = strtoull(tokens[4], &end4, 10);
+            auto &chrom = ans->chroms_[tokens[0]];
+            if (*end1 || *end2 || *end4 || end1 == tokens[1] || end2 == tokens[2] ||
+                end4 == tokens[4] || (!chrom.empty() && ck.pos < chrom.back().pos)) {
+                throw runtime_error("invalid checkpoint index " + filename);
             }
+            chrom.push_back(ck);
+        }
+        if (in.bad()) {
+            throw runtime_error("Failed to read " + filename);
+        }
+        return ans;
+    }
 
-            itr->Next();
+    // The last checkpoint on chrom with POS < lo, failing which the first on chrom (or nullptr)
+    const Checkpoint *Find(const string &chrom, uint64_t lo) const {
+        auto p = chroms_.find(chrom);
+        if (p == chroms_.end() || p->second.empty()) {
+            return nullptr;
+        }
+        auto it = lower_bound(p->second.begin(), p->second.end(), lo,
+                              [](const Checkpoint &ck, uint64_t x) { return ck.pos < x; });
+        return it == p->second.begin() ? &*it : &*(it - 1);
+    }
 
-            if (linepos >= region_lo) {
-                // output this row as a new checkpoint
-                out << decoded_line << '\n';
-                break;
+  private:
+    unordered_map<string, vector<Checkpoint>> chroms_;
+};
+
+// From the checkpoint at itr, run spVCF decoder until we see a line with POS >= region_lo, and
+// output it as a new checkpoint followed by the remaining lines (rewriting spVCF_checkpointPOS
+// until the next checkpoint). Returns false if itr ends before any line reaches region_lo.
+template <class Iterator>
+static bool SliceFromCheckpoint(Iterator &itr, uint64_t region_lo, const string &ck_region,
+                                std::ostream &out) {
+    // TODO: the correct condition may be END >= region_lo. Needs careful testing.
+    // Lines preceding that only need to update the decoder state, so we skip over them.
+    auto decoder = NewDecoder(false);
+    string linecpy, INFO;
+    vector<char *> tokens;
+    uint64_t linepos = ULLONG_MAX;
+    while (true) {
+        linecpy = itr.Line();
+
+        const char *POS = strchr(linecpy.c_str(), '\t');
+        errno = 0;
+        linepos = POS ? strtoull(POS + 1, nullptr, 10) : 0;
+        if (!POS || errno) {
+            throw runtime_error("invalid POS while looking for checkpoint in " + ck_region);
+        }
+
+        itr.Next();
+
+        if (linepos >= region_lo) {
+            // output this row as a new checkpoint
+            const char *decoded_line = decoder->ProcessLine(&linecpy[0]);
+            out.write(decoded_line, decoder->OutputLength());
+            out << '\n';
+            break;
+        }
+        decoder->SkipLine(&linecpy[0]);
+
+        if (!itr.Valid()) {
+            return false;
+        }
+    }
+
+    // Copy subsequent lines up until the next checkpoint, setting
+    // spVCF_checkpointPOS=linepos.
+    for (; itr.Valid(); itr.Next()) {
+        linecpy = itr.Line();
+        tokens.clear();
+        split(linecpy, '\t', back_inserter(tokens), 9);
+        if (tokens.size() < 10) {
+            throw runtime_error("read line with fewer than 10 columns");
+        }
+        INFO = tokens[7];
+        if (INFO.substr(0, 20) != "spVCF_checkpointPOS=") {
+            break;
+        }
+
+        string newINFO = "spVCF_checkpointPOS=" + to_string(linepos);
+        auto sc = INFO.find(';');
+        if (sc != string::npos) {
+            newINFO = newINFO + ";" + INFO.substr(sc + 1);
+        }
+
+        for (int i = 0; i < tokens.size(); i++) {
+            if (i) {
+                out << '\t';
+            }
+            if (i != 7) {
+                out << tokens[i];
+            } else {
+                out << newINFO;
             }
+        }
+        out << '\n';
+    }
+
+    // Copy remaining lines unmodified
+    for (; itr.Valid(); itr.Next()) {
+        out << itr.Line() << '\n';
+    }
+    return true;
+}
+
+// Open spvcf_gz and its tabix index
+static pair<shared_ptr<htsFile>, shared_ptr<tbx_t>> OpenTabix(const string &spvcf_gz) {
+    // Open the file
+    auto fp = shared_ptr<htsFile>(hts_open(spvcf_gz.c_str(), "r"), [](htsFile *f) {
+        if (f && hts_close(f))
+            throw runtime_error("hts_close");
+    });
+    if (!fp) {
+        throw runtime_error("Failed to open " + spvcf_gz);
+    }
+
+    // Open the index file
+    auto tbx = shared_ptr<tbx_t>(tbx_index_load(spvcf_gz.c_str()), [](tbx_t *t) {
+        if (t)
+            tbx_destroy(t);
+    });
+    if (!tbx) {
+        throw runtime_error("Falied to open .tbi/.csi index of " + spvcf_gz);
+    }
+    return make_pair(fp, tbx);
+}
 
-            if (!itr->Valid()) {
-                throw runtime_error("Couldn't resume from checkpoint " + ck_region + " for " +
-                                    region);
+// Slice one region from fp (positioned anywhere) to out
+static void SliceRegion(htsFile *fp, tbx_t *tbx, const CheckpointIndex *ckpts,
+                        const string &spvcf_gz, const string &region, std::ostream &out) {
+    // Parse the region as either 'chrom' or 'chrom:lo-hi'
+    string region_chrom, region_hi;
+    uint64_t region_lo = ULLONG_MAX;
+    auto c = region.find(':');
+    if (c == string::npos) {
+        region_chrom = region;
+    } else {
+        region_chrom = region.substr(0, c);
+        auto d = region.find('-', c);
+        if (c == 0 || d == string::npos || d <= c + 1 || d >= region.size() - 1) {
+            throw runtime_error("invalid region " + region);
+        }
+        errno = 0;
+        region_lo = strtoull(region.substr(c + 1, d - c - 1).c_str(), nullptr, 10);
+        if (errno) {
+            throw runtime_error("invalid region lo " + region);
+        }
+        region_hi = region.substr(d + 1);
+        assert(region_hi.size());
+    }
+    assert(region_chrom.size());
+
+    const CheckpointIndex::Checkpoint *ckpt = nullptr;
+    uint64_t hi = 0;
+    if (ckpts && region_lo != ULLONG_MAX) {
+        errno = 0;
+        hi = strtoull(region_hi.c_str(), nullptr, 10);
+        if (errno) {
+            throw runtime_error("invalid region hi " + region);
+        }
+        ckpt = ckpts->Find(region_chrom, region_lo);
+        if (!ckpt) {
+            return;
+        }
+        if (ckpt->prior_end >= region_lo) {
+            // Some line preceding the checkpoint overlaps the region; if it's a checkpoint then
+            // the tabix logic below begins the slice with it, so defer to that.
+            ckpt = nullptr;
+        }
+    }
+    if (ckpt) {
+        // Seek straight to the last checkpoint before region_lo
+        CheckpointIterator itr(fp, ckpt->voffset, region_chrom, hi);
+        string linecpy(itr.Valid() ? itr.Line() : "");
+        vector<char *> tokens;
+        split(linecpy, '\t', back_inserter(tokens), 9);
+        if (!itr.Valid() && ckpt->pos > hi) {
+            // the chromosome's first checkpoint lies beyond the region
+            return;
+        }
+        if (tokens.size() < 10 || itr.POS() != ckpt->pos ||
+            string(tokens[7]).substr(0, 20) == "spVCF_checkpointPOS=") {
+            throw runtime_error("checkpoint index doesn't match " + spvcf_gz);
+        }
+        if (ckpt->pos >= region_lo) {
+            // the region begins with the chromosome's first checkpoint
+            for (; itr.Valid(); itr.Next()) {
+                out << itr.Line() << '\n';
             }
+            return;
+        }
+        // Unless the checkpoint itself overlaps the region (by the length of REF or INFO END), in
+        // which case the tabix logic below copies it as-is
+        uint64_t ck_end = ckpt->pos + max(size_t(1), strlen(tokens[3])) - 1;
+        const char *END = strncmp(tokens[7], "END=", 4) == 0 ? tokens[7] + 4 : nullptr;
+        if (!END && (END = strstr(tokens[7], ";END="))) {
+            END += 5;
+        }
+        if (END) {
+            ck_end = max(ck_end, uint64_t(strtoull(END, nullptr, 10)));
+        }
+        if (ck_end < region_lo) {
+            string ck_region = region_chrom + ":" + to_string(ckpt->pos) + "-" + region_hi;
+            SliceFromCheckpoint(itr, region_lo, ck_region, out);
+            return;
         }
+    }
+
+    // Read the first line in this region
+    auto itr = TabixIterator::Open(fp, tbx, region.c_str());
+    if (!itr || !itr->Valid()) {
+        return;
+    }
 
-        // Copy subsequent lines up until the next checkpoint, setting
-        // spVCF_checkpointPOS=linepos.
+    // extract INFO spVCF_checkpointPOS=ck.
+    vector<char *> tokens;
+    string linecpy(itr->Line());
+    split(linecpy, '\t', back_inserter(tokens), 9);
+    if (tokens.size() < 10) {
+        throw runtime_error("read line with fewer than 10 columns");
+    }
+    string INFO = tokens[7];
+    if (INFO.substr(0, 20) != "spVCF_checkpointPOS=") {
+        // This first line happens to be a checkpoint, so we can just copy
+        // all the encoded spVCF. This occurs when slicing a whole
+        // chromosome since the first line for each chromosome is a
+        // checkpoint, but it can also happen fortuitously in the middle.
         for (; itr->Valid(); itr->Next()) {
-            linecpy = itr->Line();
-            tokens.clear();
-            split(linecpy, '\t', back_inserter(tokens), 9);
-            if (tokens.size() < 10) {
-                throw runtime_error("read line with fewer than 10 columns");
+            out << itr->Line() << '\n';
+        }
+        return;
+    }
+    if (region_lo == ULLONG_MAX) {
+        throw runtime_error("First line for chromosome was not a checkpoint: " + region);
+    }
+    errno = 0;
+    uint64_t ck = strtoull(INFO.substr(20, INFO.find(';')).c_str(), nullptr, 10);
+    if (errno || ck >= region_lo) {
+        throw runtime_error("invalid spVCF_checkpointPOS field");
+    }
+
+    // Reopen iterator on chrom:ck-hi
+    assert(region_hi.size());
+    string ck_region = region_chrom + ":" + to_string(ck) + "-" + region_hi;
+    itr = TabixIterator::Open(fp, tbx, ck_region.c_str());
+    if (!itr || !itr->Valid()) {
+        throw runtime_error("couldn't open checkpoint region " + ck_region + " before " + region);
+    }
+
+    // Find the first checkpoint in this expanded region (it's not
+    // guaranteed to be the very first result in all cases)
+    uint64_t linepos = ULLONG_MAX;
+    while (true) {
+        linecpy = itr->Line();
+        tokens.clear();
+        split(linecpy, '\t', back_inserter(tokens), 9);
+        if (tokens.size() < 10) {
+            throw runtime_error("read line with fewer than 10 columns");
+        }
+        errno = 0;
+        linepos = strtoull(tokens[1], nullptr, 10);
+        if (errno) {
+            throw runtime_error("invalid POS " + string(tokens[1]) +
+                                " while looking for checkpoint in " + ck_region);
+        }
+        if (string(tokens[7]).substr(0, 20) != "spVCF_checkpointPOS=") {
+            break;
+        }
+        itr->Next();
+        // We're expecting to find the checkpoint before region_lo
+        if (!itr->Valid() || linepos >= region_lo) {
+            throw runtime_error("couldn't find checkpoint in " + ck_region + " before " + region);
+        }
+    }
+
+    if (!SliceFromCheckpoint(*itr, region_lo, ck_region, out)) {
+        throw runtime_error("Couldn't resume from checkpoint " + ck_region + " for " + region);
+    }
+}
+
+// Run work(state, i) for i in [0, count) on several threads, writing the results to out in
+// order. Each thread first calls init() for its own state (e.g. file handles). To bound memory
+// usage, the workers may get only so far ahead of the output.
+template <class State>
+static void InOrderParallel(size_t count, size_t threads, const function<State()> &init,
+                            const function<string(State &, size_t)> &work, ostream &out) {
+    const size_t window = 2 * threads;
+    vector<string> results(count);
+    vector<bool> done(count, false);
+    size_t next = 0, emitted = 0;
+    mutex mu;
+    condition_variable cv;
+    exception_ptr error;
+    auto worker = [&]() {
+        try {
+            State state = init();
+            while (true) {
+                size_t i;
+                {
+                    unique_lock<mutex> lock(mu);
+                    cv.wait(lock, [&] { return error || next == count || next < emitted + window; });
+                    if (error || next == count) {
+                        return;
+                    }
+                    i = next++;
+                }
+                string result = work(state, i);
+                lock_guard<mutex> lock(mu);
+                results[i] = move(result);
+                done[i] = true;
+                cv.notify_all();
             }
-            INFO = tokens[7];
-            if (INFO.substr(0, 20) != "spVCF_checkpointPOS=") {
+        } catch (...) {
+            lock_guard<mutex> lock(mu);
+            if (!error) {
+                error = current_exception();
+            }
+            cv.notify_all();
+        }
+    };
+    vector<thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
+    {
+        unique_lock<mutex> lock(mu);
+        while (emitted < count) {
+            cv.wait(lock, [&] { return error || done[emitted]; });
+            if (error) {
                 break;
             }
+            string result;
+            swap(result, results[emitted++]);
+            cv.notify_all();
+            lock.unlock();
+            out << result;
+            lock.lock();
+        }
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    if (error) {
+        rethrow_exception(error);
+    }
+}
 
-            string newINFO = "spVCF_checkpointPOS=" + to_string(linepos);
-            auto sc = INFO.find(';');
-            if (sc != string::npos) {
-                newINFO = newINFO + ";" + INFO.substr(sc + 1);
-            }
+void TabixSlice(const std::string &spvcf_gz, std::vector<std::string> regions, std::ostream &out,
+                size_t threads) {
+    shared_ptr<htsFile> fp;
+    shared_ptr<tbx_t> tbx;
+    tie(fp, tbx) = OpenTabix(spvcf_gz);
+
+    // Load the checkpoint sidecar, if any
+    auto ckpts = CheckpointIndex::Load(spvcf_gz);
+
+    // Copy the header lines
+    kstring_t str = {0, 0, 0};
+    while (hts_getline(fp.get(), KS_SEP_LINE, &str) >= 0) {
+        if (!str.l || str.s[0] != tbx->conf.meta_char) {
+            break;
+        }
+        out << str.s << '\n';
+    }
+
+    threads = min(threads, regions.size());
+    if (threads <= 1) {
+        for (const auto &region : regions) {
+            SliceRegion(fp.get(), tbx.get(), ckpts.get(), spvcf_gz, region, out);
+        }
+        return;
+    }
+
+    // Slice the regions concurrently, each worker thread with its own file handle & index
+    typedef pair<shared_ptr<htsFile>, shared_ptr<tbx_t>> Handles;
+    InOrderParallel<Handles>(
+        regions.size(), threads, [&]() { return OpenTabix(spvcf_gz); },
+        [&](Handles &h, size_t i) {
+            ostringstream slice;
+            SliceRegion(h.first.get(), h.second.get(), ckpts.get(), spvcf_gz, regions[i], slice);
+            return slice.str();
+        },
+        out);
+}
+
+// Per-sample QC statistics for each chromosome. Rather than updating N accumulators per row, we
+// parse each column's current cell once into its contributions, and credit them for all the rows
+// the cell spanned when an explicit cell supersedes it (or at the end of the chromosome). Quoted
+// cells cost nothing, so each row costs time proportional to its explicit cells.
+class SampleStatsImpl {
+  public:
+    SampleStatsImpl(const vector<string> &samples, ostream &out)
+        : samples_(samples), out_(out), cells_(samples.size()), totals_(samples.size()) {
+        text_.Reset(samples.size());
+    }
+    SampleStatsImpl(const SampleStatsImpl &) = delete;
+
+    void ProcessLine(char *input_line);
+    // write the table for the last chromosome
+    void Finish() { finish_chrom(); }
 
-            for (int i = 0; i < tokens.size(); i++) {
-                if (i) {
-                    out << '\t';
+  private:
+    // the contributions of a column's current cell, valid since row `since` of the chromosome
+    struct Cell {
+        uint64_t since = 0;
+        uint32_t DP = 0;
+        bool present = false, missing = false, het = false, nonref = false, has_DP = false;
+    };
+    struct Totals {
+        uint64_t missing = 0, het = 0, nonref = 0, DP_sites = 0, DP_sum = 0;
+    };
+
+    void fail(const string &msg) {
+        ostringstream ss;
+        ss << "spvcf: " << msg << " (line " << line_number_ << ")";
+        throw runtime_error(ss.str());
+    }
+    void parse_cell(const char *t, Cell &cell);
+    void credit(uint64_t s) {
+        const Cell &c = cells_[s];
+        const uint64_t rows = rows_ - c.since;
+        Totals &tot = totals_[s];
+        tot.missing += c.missing * rows;
+        tot.het += c.het * rows;
+        tot.nonref += c.nonref * rows;
+        if (c.has_DP) {
+            tot.DP_sites += rows;
+            tot.DP_sum += uint64_t(c.DP) * rows;
+        }
+    }
+    void finish_chrom();
+
+    vector<string> samples_;
+    ostream &out_;
+    uint64_t line_number_ = 0;
+    string chrom_, format_;
+    uint64_t rows_ = 0; // of chrom_ so far
+    int iDP_ = -1;      // index of DP in format_
+    vector<Cell> cells_;
+    vector<Totals> totals_;
+    DenseCells text_; // current cell of each column, to reinterpret if the FORMAT changes
+    vector<char *> tokens_;
+};
+
+void SampleStatsImpl::ProcessLine(char *input_line) {
+    ++line_number_;
+    tokens_.clear();
+    split(input_line, '\t', back_inserter(tokens_));
+    if (tokens_.size() < 10) {
+        fail("Invalid spVCF: fewer than 10 columns");
+    }
+    if (chrom_ != tokens_[0]) {
+        finish_chrom();
+        chrom_ = tokens_[0];
+        if (strncmp(tokens_[7], "spVCF_checkpointPOS=", 20) == 0) {
+            fail("Missing preceding dense cells (chromosome must begin with a checkpoint)");
+        }
+    }
+
+    // Locate DP in FORMAT. If it moves, then the quoted cells must be reinterpreted.
+    if (format_ != tokens_[8]) {
+        format_ = tokens_[8];
+        int iDP = -1, i = 0;
+        for (const char *p = tokens_[8]; p; p = strchr(p, ':'), i++) {
+            p += (i > 0);
+            if (p[0] == 'D' && p[1] == 'P' && (p[2] == ':' || !p[2])) {
+                iDP = i;
+                break;
+            }
+        }
+        if (iDP != iDP_) {
+            iDP_ = iDP;
+            for (uint64_t s = 0; s < cells_.size(); s++) {
+                if (cells_[s].present) {
+                    credit(s);
+                    parse_cell(text_.Get(s), cells_[s]);
+                    cells_[s].since = rows_;
                 }
-                if (i != 7) {
-                    out << tokens[i];
-                } else {
-                    out << newINFO;
+            }
+        }
+    }
+
+    auto update = [&](uint64_t lo, uint64_t, const char *cell) {
+        if (cell) {
+            Cell &c = cells_[lo];
+            if (c.present) {
+                credit(lo);
+            }
+            parse_cell(cell, c);
+            c.since = rows_;
+            text_.Set(lo, cell, strlen(cell), 0);
+        }
+    };
+    for_sparse_cells(tokens_, cells_.size(), [this](const string &msg) { fail(msg); }, update);
+    ++rows_;
+}
+
+void SampleStatsImpl::parse_cell(const char *t, Cell &cell) {
+    cell.present = true;
+    // GT
+    bool called = true, nonref = false;
+    int ploidy = 0;
+    long first = -1;
+    cell.het = false;
+    const char *p = t;
+    while (true) {
+        if (*p == '.') {
+            called = false;
+            ++p;
+        } else if (*p >= '0' && *p <= '9') {
+            char *end = nullptr;
+            long a = strtol(p, &end, 10);
+            nonref = nonref || a > 0;
+            if (!ploidy) {
+                first = a;
+            } else if (a != first && first >= 0) {
+                cell.het = true;
+            }
+            p = end;
+        } else {
+            fail("invalid GT");
+        }
+        ++ploidy;
+        if (*p != '/' && *p != '|') {
+            break;
+        }
+        ++p;
+    }
+    if (*p && *p != ':') {
+        fail("invalid GT");
+    }
+    cell.missing = !called;
+    cell.het = cell.het && called;
+    cell.nonref = nonref;
+
+    // DP
+    cell.has_DP = false;
+    if (iDP_ > 0) {
+        for (int i = 0; i < iDP_ && p; i++) {
+            p = strchr(p + (i > 0), ':');
+        }
+        if (p && p[1] >= '0' && p[1] <= '9') {
+            cell.DP = uint32_t(min(strtoul(p + 1, nullptr, 10), (unsigned long)UINT32_MAX));
+            cell.has_DP = true;
+        }
+    }
+}
+
+void SampleStatsImpl::finish_chrom() {
+    if (!rows_) {
+        return;
+    }
+    for (uint64_t s = 0; s < cells_.size(); s++) {
+        if (cells_[s].present) {
+            credit(s);
+        }
+        const Totals &tot = totals_[s];
+        out_ << chrom_ << '\t' << samples_[s] << '\t' << rows_ << '\t' << tot.missing << '\t'
+             << tot.het << '\t' << tot.nonref << '\t';
+        if (tot.DP_sites) {
+            char mean[32];
+            snprintf(mean, sizeof(mean), "%.2f", double(tot.DP_sum) / tot.DP_sites);
+            out_ << mean << '\n';
+        } else {
+            out_ << ".\n";
+        }
+    }
+    cells_.assign(cells_.size(), Cell());
+    totals_.assign(totals_.size(), Totals());
+    rows_ = 0;
+}
+
+static const char *sample_stats_header = "#CHROM\tSAMPLE\tSITES\tMISSING\tHET\tNONREF\tMEAN_DP\n";
+
+// Sample names from the #CHROM header line
+static vector<string> HeaderSamples(char *header_line) {
+    vector<char *> tokens;
+    split(header_line, '\t', back_inserter(tokens));
+    if (tokens.size() < 10) {
+        throw runtime_error("spvcf: invalid #CHROM header line: fewer than 10 columns");
+    }
+    return vector<string>(tokens.begin() + 9, tokens.end());
+}
+
+void SampleStats(const string &spvcf, ostream &out, size_t threads) {
+    if (threads <= 1) {
+        out << sample_stats_header;
+        LineReader input(spvcf);
+        unique_ptr<SampleStatsImpl> stats;
+        size_t len;
+        for (char *line; (line = input.NextLine(len));) {
+            if (*line == '#' || !len) {
+                if (strncmp(line, "#CHROM\t", 7) == 0) {
+                    stats = make_unique<SampleStatsImpl>(HeaderSamples(line), out);
                 }
+            } else if (!stats) {
+                throw runtime_error("spvcf: samplestats requires the #CHROM header line");
+            } else {
+                stats->ProcessLine(line);
             }
-            out << '\n';
         }
+        if (stats) {
+            stats->Finish();
+        }
+        return;
+    }
 
-        // Copy remaining lines unmodified
-        for (; itr->Valid(); itr->Next()) {
-            out << itr->Line() << '\n';
+    // Process the chromosomes concurrently, each worker thread with its own file handle & index
+    shared_ptr<htsFile> fp;
+    shared_ptr<tbx_t> tbx;
+    tie(fp, tbx) = OpenTabix(spvcf);
+    vector<string> samples;
+    kstring_t str = {0, 0, 0};
+    while (samples.empty() && hts_getline(fp.get(), KS_SEP_LINE, &str) >= 0 && str.l &&
+           str.s[0] == tbx->conf.meta_char) {
+        if (strncmp(str.s, "#CHROM\t", 7) == 0) {
+            samples = HeaderSamples(str.s);
         }
     }
+    free(str.s);
+    if (samples.empty()) {
+        throw runtime_error("spvcf: samplestats requires the #CHROM header line");
+    }
+    int n = 0;
+    const char **names = tbx_seqnames(tbx.get(), &n);
+    vector<string> chroms(names, names + n);
+    free(names);
+
+    out << sample_stats_header;
+    typedef pair<shared_ptr<htsFile>, shared_ptr<tbx_t>> Handles;
+    InOrderParallel<Handles>(
+        chroms.size(), threads, [&]() { return OpenTabix(spvcf); },
+        [&](Handles &h, size_t i) {
+            ostringstream table;
+            SampleStatsImpl stats(samples, table);
+            string line;
+            for (auto itr = TabixIterator::Open(h.first.get(), h.second.get(), chroms[i].c_str());
+                 itr && itr->Valid(); itr->Next()) {
+                line = itr->Line();
+                stats.ProcessLine(&line[0]);
+            }
+            stats.Finish();
+            return table.str();
+        },
+        out);
 }
 
 } // namespace spVCF
@@ -1,8 +1,15 @@
+#pragma once
+
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <vector>
 
+struct hts_tpool;
+struct bcf_hdr_t;
+struct bcf1_t;
+
 namespace spVCF {
 
 struct transcode_stats {
@@ -16,6 +23,12 @@ struct transcode_stats {
 
     uint64_t squeezed_cells = 0; // cells whose QC measures were dropped
     uint64_t checkpoints = 0;    // checkpoints (purposely dense rows to aid partial decoding)
+    uint64_t sparse_bytes = 0;   // encoded lines (excluding header), including newlines
+    // bytes of the longest checkpoint interval (a checkpoint & the lines up to the next)
+    uint64_t max_checkpoint_interval_bytes = 0;
+    // histogram of the checkpoint interval bytes, with eight buckets per power of two
+    static const int interval_buckets = 496;
+    uint64_t checkpoint_interval_hist[interval_buckets] = {0};
 
     void operator+=(const transcode_stats &rhs) {
         N = std::max(N, rhs.N);
@@ -26,18 +39,119 @@ struct transcode_stats {
         sparse99_lines += rhs.sparse99_lines;
         squeezed_cells += rhs.squeezed_cells;
         checkpoints += rhs.checkpoints;
+        sparse_bytes += rhs.sparse_bytes;
+        max_checkpoint_interval_bytes =
+            std::max(max_checkpoint_interval_bytes, rhs.max_checkpoint_interval_bytes);
+        for (int i = 0; i < interval_buckets; i++) {
+            checkpoint_interval_hist[i] += rhs.checkpoint_interval_hist[i];
+        }
     }
+
+    static int interval_bucket(uint64_t bytes);
+    // the pct-th percentile of the checkpoint interval bytes, overstated by less than 1/8
+    uint64_t checkpoint_interval_percentile(unsigned pct) const;
 };
 
 class Transcoder {
   public:
     virtual const char *ProcessLine(char *input_line) = 0; // input_line is consumed (damaged)
+    virtual size_t OutputLength() const = 0; // strlen of the last ProcessLine() result
     virtual transcode_stats Stats() = 0;
+    // Forget the codec state, as if starting over at the beginning of a stream: the encoder will
+    // make the next line a checkpoint, and the decoder will require it to be one. (Stats continue
+    // to accumulate.)
+    virtual void Restart() = 0;
+    // Update the codec state with input_line, like ProcessLine() but without producing output
+    // (which the decoder can do in time proportional to the sparse line length, rather than N)
+    virtual void SkipLine(char *input_line) { ProcessLine(input_line); }
 };
+// column_threads > 1 divides each (very wide) row into stripes of columns processed concurrently.
+// checkpoint_bytes > 0 adds a checkpoint whenever the spVCF output since the last one reaches
+// that many bytes (bounding the decoding needed to reach any line), besides those placed by
+// checkpoint_period (if > 0) and at each new chromosome.
 std::unique_ptr<Transcoder> NewEncoder(uint64_t checkpoint_period, bool sparse, bool squeeze,
-                                       double roundDP_base);
-std::unique_ptr<Transcoder> NewDecoder(bool with_missing_fields);
+                                       double roundDP_base, size_t column_threads = 1,
+                                       uint64_t checkpoint_bytes = 0);
+
+// Encoder also accepting each pVCF line already split into its columns (CHROM through FORMAT,
+// then the N cells), for embedding callers who'd otherwise have to format the line as text. The
+// header lines still go through ProcessLine().
+class RowEncoder : public Transcoder {
+  public:
+    // columns[0..n) are consumed (damaged); the result is the spVCF line, as from ProcessLine()
+    virtual const char *ProcessRow(char *const *columns, size_t n) = 0;
+    // Encode a BCF record (e.g. from htslib bcf_read), formatting as text only the cells that
+    // differ from their columns' last ones. (Don't mix with ProcessLine/ProcessRow data lines.)
+    virtual const char *ProcessBCF(bcf_hdr_t *hdr, bcf1_t *rec) = 0;
+};
+std::unique_ptr<RowEncoder> NewRowEncoder(uint64_t checkpoint_period, bool sparse, bool squeeze,
+                                          double roundDP_base, size_t column_threads = 1,
+                                          uint64_t checkpoint_bytes = 0);
+// If samples are given, then decode only those columns (named in the #CHROM header line)
+std::unique_ptr<Transcoder> NewDecoder(bool with_missing_fields,
+                                       const std::vector<std::string> &samples = {});
+// Decoder writing BGZF-compressed BCF (via htslib) instead of VCF text. Each column's last dense
+// cell is kept parsed into its BCF values, so quoted cells are copied without parsing them again.
+class BCFDecoder {
+  public:
+    virtual ~BCFDecoder() = default;
+    virtual void ProcessLine(char *input_line) = 0; // input_line is consumed (damaged)
+    virtual transcode_stats Stats() = 0;
+    virtual void Close() = 0; // finish writing the output file
+};
+// Write filename (- for standard output), using the thread pool (if any) for BGZF compression
+std::unique_ptr<BCFDecoder> NewBCFDecoder(const std::string &filename,
+                                          const std::vector<std::string> &samples = {},
+                                          hts_tpool *pool = nullptr);
+
+// Subset spVCF to the given samples, still sparse-encoded
+std::unique_ptr<Transcoder> NewSubsetter(const std::vector<std::string> &samples);
+
+// Compute per-site genotype statistics (AC, AN, AF, NS, F_MISSING, N_HET, N_HOMALT) from spVCF,
+// without decoding it, and output them as a sites-only VCF with those INFO fields
+std::unique_ptr<Transcoder> NewSiteStats();
+
+// One entry of a sparse row: either the explicit cell for column lo (with hi = lo+1), or a run of
+// quotes (with cell = nullptr) over columns [lo, hi), each of which repeats its own last explicit
+// cell from a preceding row.
+struct sparse_cell {
+    uint64_t lo = 0, hi = 0;
+    const char *cell = nullptr;
+};
+
+struct sparse_row {
+    // CHROM POS ID REF ALT QUAL FILTER INFO FORMAT, with spVCF_checkpointPOS removed from INFO
+    const char *fields[9] = {nullptr};
+    uint64_t POS = 0;
+    // checkpoint rows have every cell explicit; otherwise checkpoint_pos is the POS of the last one
+    bool checkpoint = false;
+    uint64_t checkpoint_pos = 0;
+    std::vector<sparse_cell> cells;
+};
+
+// Streaming reader for embedding callers to consume spVCF in-process, visiting each row's explicit
+// cells and quote runs without expanding them into the N dense cells.
+class SparseReader {
+  public:
+    virtual ~SparseReader() = default;
+    // header lines, through the #CHROM line, as read from the file
+    virtual const std::vector<std::string> &Header() const = 0;
+    // sample names, from the #CHROM line
+    virtual const std::vector<std::string> &Samples() const = 0;
+    // Read the next row, or return nullptr at the end of the input. The row remains valid until
+    // the next call.
+    virtual const sparse_row *NextRow() = 0;
+};
+// Read filename (uncompressed, gzip or bgzip), or standard input if "-"
+std::unique_ptr<SparseReader> NewSparseReader(const std::string &filename = "-");
+
+// threads > 1 slices several regions concurrently (still outputting them in order)
+void TabixSlice(const std::string &spvcf_gz, std::vector<std::string> regions, std::ostream &out,
+                size_t threads = 1);
 
-void TabixSlice(const std::string &spvcf_gz, std::vector<std::string> regions, std::ostream &out);
+// Per-sample QC statistics of spVCF for each chromosome, as TSV: the number of sites, and of those
+// with missing, heterozygous and non-reference GT, and the mean DP. threads > 1 processes several
+// chromosomes concurrently, which requires the spVCF to be bgzipped and tabix-indexed.
+void SampleStats(const std::string &spvcf, std::ostream &out, size_t threads = 1);
 
 } // namespace spVCF
@@ -0,0 +1,614 @@
+// Buffered output to a file descriptor (standard output, a file, or a pipe). Lines are copied
+// into a large page-aligned buffer which is written out with one syscall whenever it fills; a
+// chunk too big to be worth copying is written straight from the caller's memory, along with the
+// buffered bytes preceding it, by one writev().
+//
+// Alternatively the output may be BGZF-compressed, in blocks dispatched to an htslib thread pool
+// (if given). Since we know where each block lands in the file, we can also build the tabix index
+// of BGZF VCF output as it's written, and/or the spVCF checkpoint sidecar (.ckpt) locating each
+// checkpoint line, and/or begin a new block at each checkpoint line. Errors are reported by
+// throwing runtime_error.
+#pragma once
+
+#include "htslib/bgzf.h"
+#include "htslib/hts.h"
+#include "htslib/tbx.h"
+#include "htslib/thread_pool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <string>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace spVCF {
+
+class FileWriter {
+  public:
+    static const size_t default_capacity = 1 << 20;
+    static const int bgzf_level = 6;
+
+    // Create or truncate filename for writing, or write to standard output if "-". If bgzf, then
+    // compress the output (using pool, if given).
+    explicit FileWriter(const std::string &filename = "-", bool bgzf = false,
+                        hts_tpool *pool = nullptr, size_t capacity = default_capacity)
+        : filename_(filename), capacity_(capacity) {
+        if (filename == "-") {
+            fd_ = STDOUT_FILENO;
+        } else {
+            fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd_ < 0) {
+                throw std::runtime_error("Failed to open output file");
+            }
+            owned_ = true;
+        }
+        // page alignment suits the kernel's copy from the buffer
+        if (posix_memalign((void **)&buf_, 4096, capacity_) != 0) {
+            throw std::bad_alloc();
+        }
+        if (bgzf) {
+            bgzf_ = true;
+            if (pool) {
+                // enough blocks in flight to keep the pool busy
+                max_in_flight_ = 2 * size_t(hts_tpool_size(pool));
+                q_ = hts_tpool_process_init(pool, max_in_flight_, 0);
+                if (!q_) {
+                    throw std::runtime_error("Failed to set up BGZF thread pool");
+                }
+                pool_ = pool;
+            }
+            cur_ = new_block();
+        }
+    }
+
+    FileWriter(const FileWriter &) = delete;
+
+    // Best-effort flush if Close() wasn't called (e.g. unwinding from an exception); errors here
+    // go unreported, and no index is saved.
+    ~FileWriter() {
+        if (fd_ >= 0) {
+            try {
+                finish();
+            } catch (std::exception &) {
+            }
+            if (owned_) {
+                close(fd_);
+            }
+        }
+        if (q_) {
+            hts_tpool_process_destroy(q_);
+        }
+        for (Block *block : free_blocks_) {
+            delete block;
+        }
+        delete cur_;
+        if (idx_) {
+            hts_idx_destroy(idx_);
+        }
+        free(buf_);
+    }
+
+    // Build a tabix index of the (BGZF, VCF) output as it's written, to be saved alongside the
+    // output file by Close(). The index is .tbi, or .csi if csi (needed for contigs >512Mbp).
+    void Index(bool csi) {
+        if (!bgzf_ || !owned_) {
+            throw std::runtime_error("indexing requires bgzip output to a file");
+        }
+        indexing_ = true;
+        csi_ = csi;
+    }
+
+    // Record the BGZF virtual offset of each spVCF checkpoint line (data line without
+    // spVCF_checkpointPOS in INFO), to be saved by Close() in the sidecar file filename.ckpt:
+    //   #spVCF_checkpoints <tab> size of the BGZF file in bytes
+    //   CHROM <tab> POS <tab> virtual offset <tab> ordinal of the line among the data lines <tab>
+    //     greatest END (by REF length or INFO END) of the preceding lines on CHROM, or 0
+    // The file size lets readers recognize a sidecar left over from an earlier version of the file.
+    // The END lets them tell whether some earlier line overlaps a position after the checkpoint.
+    void IndexCheckpoints() {
+        if (!bgzf_ || !owned_) {
+            throw std::runtime_error("checkpoint index requires bgzip output to a file");
+        }
+        checkpointing_ = true;
+    }
+
+    // End the current BGZF block before each spVCF checkpoint line, so that every checkpoint
+    // begins a block (at a virtual offset with zero within-block offset). Then seeking to a
+    // checkpoint inflates no preceding data, and the checkpoint intervals occupy disjoint blocks.
+    // This requires each line's leading fields (through the beginning of INFO) to be written in
+    // one Write(), as all our callers do; otherwise the line is left unaligned.
+    void AlignCheckpoints() {
+        if (!bgzf_) {
+            throw std::runtime_error("aligning checkpoints requires bgzip output");
+        }
+        aligning_ = true;
+    }
+
+    inline void Write(const char *s, size_t len) {
+        if (bgzf_) {
+            bgzf_write_data(s, len);
+        } else {
+            raw_write(s, len);
+        }
+    }
+
+    inline void Write(char c) {
+        if (bgzf_) {
+            bgzf_write_data(&c, 1);
+            return;
+        }
+        if (size_ == capacity_) {
+            flush_buffer();
+        }
+        buf_[size_++] = c;
+    }
+
+    inline void Write(const std::string &s) { Write(s.data(), s.size()); }
+
+    // Flush (finishing the BGZF stream), close the file (if we opened it), and save the index
+    void Close() {
+        finish();
+        bool ok = !owned_ || close(fd_) == 0;
+        fd_ = -1;
+        if (!ok) {
+            throw std::runtime_error("Failed to close output file");
+        }
+        if (indexing_) {
+            save_index();
+        }
+        if (checkpointing_) {
+            save_checkpoints();
+        }
+    }
+
+  private:
+    inline void raw_write(const char *s, size_t len) {
+        if (len <= capacity_ - size_) {
+            memcpy(buf_ + size_, s, len);
+            size_ += len;
+        } else {
+            write_through(s, len);
+        }
+    }
+
+    void flush_buffer() {
+        struct iovec iov = {buf_, size_};
+        writev_all(&iov, 1);
+        size_ = 0;
+    }
+
+    void write_through(const char *s, size_t len) {
+        if (len < capacity_ / 2) {
+            // not worth a separate iovec; flush and copy
+            flush_buffer();
+            memcpy(buf_, s, len);
+            size_ = len;
+            return;
+        }
+        struct iovec iov[2] = {{buf_, size_}, {(void *)s, len}};
+        writev_all(iov, 2);
+        size_ = 0;
+    }
+
+    // writev the iovecs in their entirety, resuming after short writes & signal interruptions
+    void writev_all(struct iovec *iov, int iovcnt) {
+        while (iovcnt && iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+        }
+        while (iovcnt) {
+            ssize_t n = writev(fd_, iov, iovcnt);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("I/O error: ") + strerror(errno));
+            }
+            size_t written = size_t(n);
+            while (iovcnt && written >= iov->iov_len) {
+                written -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+            }
+            if (iovcnt) {
+                iov->iov_base = (char *)iov->iov_base + written;
+                iov->iov_len -= written;
+            }
+        }
+    }
+
+    // flush the buffer, after finishing the BGZF stream with its EOF marker block
+    void finish() {
+        if (bgzf_) {
+            if (cur_ && cur_->size) {
+                dispatch();
+            }
+            while (in_flight_) {
+                collect(true);
+            }
+            static const char eof_block[28] = {31, -117, 8, 4, 0, 0, 0, 0, 0, -1, 6, 0, 66, 67,
+                                               2,  0,    27, 0, 3, 0, 0, 0, 0, 0, 0,  0, 0, 0};
+            raw_write(eof_block, sizeof(eof_block));
+            bgzf_ = false;
+        }
+        flush_buffer();
+    }
+
+    // BGZF compression: the output is cut into blocks of BGZF_BLOCK_SIZE uncompressed bytes,
+    // numbered sequentially, which are compressed independently (possibly on the thread pool)
+    // and then written out in order.
+    struct Block {
+        uint64_t number = 0;
+        size_t size = 0, compressed_size = 0;
+        bool ok = false;
+        char data[BGZF_BLOCK_SIZE];
+        char compressed[BGZF_MAX_BLOCK_SIZE];
+    };
+
+    static void *compress_block(void *arg) {
+        Block *block = (Block *)arg;
+        block->compressed_size = sizeof(block->compressed);
+        block->ok = bgzf_compress(block->compressed, &block->compressed_size, block->data,
+                                  block->size, bgzf_level) == 0;
+        return block;
+    }
+
+    Block *new_block() {
+        Block *block;
+        if (free_blocks_.empty()) {
+            block = new Block;
+        } else {
+            block = free_blocks_.back();
+            free_blocks_.pop_back();
+        }
+        block->number = blocks_++;
+        block->size = 0;
+        return block;
+    }
+
+    void bgzf_write_data(const char *s, size_t len) {
+        if (!indexing_ && !checkpointing_ && !aligning_) {
+            bgzf_append(s, len);
+            return;
+        }
+        while (len) {
+            if (!in_line_) {
+                in_line_ = true;
+                if (aligning_ && cur_->size && is_checkpoint(s, len)) {
+                    dispatch();
+                }
+                if (!seen_data_ && indexing_ && *s != tbx_conf_vcf.meta_char && *s != '\n') {
+                    // the first data line begins here
+                    index_pending_.push_back({-1, 0, 0, cur_->number, cur_->size});
+                    seen_data_ = true;
+                }
+                // where the line begins (if the current block is full, then the next one)
+                line_block_ = cur_->number;
+                line_offset_ = cur_->size;
+                if (line_offset_ == BGZF_BLOCK_SIZE) {
+                    ++line_block_;
+                    line_offset_ = 0;
+                }
+            }
+            const char *nl = (const char *)memchr(s, '\n', len);
+            size_t n = nl ? nl + 1 - s : len;
+            const bool capture = indexing_ || checkpointing_;
+            if (capture) {
+                index_capture(s, nl ? n - 1 : n);
+            }
+            bgzf_append(s, n);
+            if (nl) {
+                if (capture) {
+                    index_line();
+                }
+                in_line_ = false;
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    // Is the line beginning at s (with len bytes available) a checkpoint, i.e. a data line without
+    // spVCF_checkpointPOS in INFO? Fewer than 20 bytes may follow INFO's start, if the line is
+    // narrow and its newline is written separately.
+    static bool is_checkpoint(const char *s, size_t len) {
+        if (!len || *s == tbx_conf_vcf.meta_char || *s == '\n') {
+            return false;
+        }
+        const char *end = s + len;
+        for (int i = 0; i < 7; i++) {
+            s = (const char *)memchr(s, '\t', end - s);
+            if (!s) {
+                return false;
+            }
+            ++s;
+        }
+        static const char prefix[] = "spVCF_checkpointPOS=";
+        const size_t n = std::min(size_t(end - s), sizeof(prefix) - 1);
+        return strncmp(s, prefix, n) != 0;
+    }
+
+    void bgzf_append(const char *s, size_t len) {
+        while (len) {
+            // a full block is dispatched lazily, upon the next write, so that the position
+            // following the preceding line may be reckoned at the end of the block.
+            if (cur_->size == BGZF_BLOCK_SIZE) {
+                dispatch();
+            }
+            size_t n = std::min(len, BGZF_BLOCK_SIZE - cur_->size);
+            memcpy(cur_->data + cur_->size, s, n);
+            cur_->size += n;
+            s += n;
+            len -= n;
+        }
+    }
+
+    void dispatch() {
+        if (!q_) {
+            compress_block(cur_);
+            Block *block = cur_;
+            cur_ = nullptr; // (in case write_block throws)
+            write_block(block);
+        } else {
+            while (in_flight_ >= max_in_flight_) {
+                collect(true);
+            }
+            if (hts_tpool_dispatch(pool_, q_, compress_block, cur_) != 0) {
+                throw std::runtime_error("Failed to dispatch BGZF compression");
+            }
+            ++in_flight_;
+            while (collect(false))
+                ;
+        }
+        cur_ = new_block();
+    }
+
+    // write the next compressed block, if available (or wait for it)
+    bool collect(bool wait) {
+        hts_tpool_result *r = wait ? hts_tpool_next_result_wait(q_) : hts_tpool_next_result(q_);
+        if (!r) {
+            if (wait) {
+                throw std::runtime_error("BGZF compression failed");
+            }
+            return false;
+        }
+        Block *block = (Block *)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        --in_flight_;
+        write_block(block);
+        return true;
+    }
+
+    void write_block(Block *block) {
+        if (!block->ok) {
+            throw std::runtime_error("BGZF compression failed");
+        }
+        if (checkpointing_) {
+            block_addresses_.push_back(compressed_offset_);
+        }
+        while (index_resolved_ < index_pending_.size() &&
+               index_pending_[index_resolved_].block == block->number) {
+            index_resolve(index_pending_[index_resolved_++], compressed_offset_ << 16);
+        }
+        // drop the resolved entries once they're the majority (moving, not reallocating, the rest)
+        if (index_resolved_ && 2 * index_resolved_ >= index_pending_.size()) {
+            index_pending_.erase(index_pending_.begin(), index_pending_.begin() + index_resolved_);
+            index_resolved_ = 0;
+        }
+        raw_write(block->compressed, block->compressed_size);
+        compressed_offset_ += block->compressed_size;
+        free_blocks_.push_back(block);
+    }
+
+    // Indexing: capture each line's leading fields (through INFO), and when the line is complete,
+    // note its interval and the position in the output following it. The position becomes a BGZF
+    // virtual offset once the blocks preceding it have been compressed, at which time we pass it
+    // on to htslib. Checkpoint lines are noted with the (block, offset) of their beginning, which
+    // are resolved to virtual offsets only when the sidecar is saved.
+    struct IndexEntry {
+        int tid; // -1 marks the beginning of the first data line
+        int64_t beg, end;
+        uint64_t block;
+        size_t offset;
+    };
+
+    struct CheckpointEntry {
+        int tid;
+        uint64_t pos, line, block;
+        size_t offset;
+        uint64_t prior_end;
+    };
+
+    void index_capture(const char *s, size_t len) {
+        while (head_tabs_ < 8 && len) {
+            const char *tab = (const char *)memchr(s, '\t', len);
+            size_t n = tab ? tab - s : len;
+            head_.append(s, n);
+            if (tab) {
+                head_ += '\t';
+                ++head_tabs_;
+                ++n;
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    // (head_ keeps its capacity from line to line, so this doesn't allocate once warmed up)
+    void index_line() {
+        if (!head_.empty() && head_[0] != tbx_conf_vcf.meta_char) {
+            index_head();
+        }
+        head_.clear();
+        head_tabs_ = 0;
+    }
+
+    void index_head() {
+        // CHROM POS ID REF ALT QUAL FILTER INFO
+        const char *fields[8];
+        size_t n_fields = 0, p = 0;
+        while (n_fields < 8) {
+            fields[n_fields++] = &head_[p];
+            p = head_.find('\t', p);
+            if (p == std::string::npos) {
+                break;
+            }
+            head_[p++] = 0;
+        }
+        if (n_fields < 4) {
+            throw std::runtime_error("indexing: truncated VCF line");
+        }
+        auto chrom = tids_.find(fields[0]);
+        if (chrom == tids_.end()) {
+            chrom = tids_.emplace(fields[0], int(seqnames_.size())).first;
+            seqnames_.push_back(fields[0]);
+        }
+        IndexEntry entry;
+        entry.tid = chrom->second;
+        char *endptr = nullptr;
+        entry.beg = strtoll(fields[1], &endptr, 10) - 1;
+        if (endptr == fields[1] || entry.beg < 0) {
+            throw std::runtime_error(std::string("indexing: invalid POS ") + fields[1]);
+        }
+        entry.end = entry.beg + std::max(size_t(1), strlen(fields[3]));
+        if (n_fields == 8) {
+            // INFO END=, as tabix understands it
+            const char *info = fields[7], *end = nullptr;
+            if (strncmp(info, "END=", 4) == 0) {
+                end = info + 4;
+            } else if ((end = strstr(info, ";END="))) {
+                end += 5;
+            }
+            if (end && *end != '.') {
+                int64_t end_pos = strtoll(end, nullptr, 10);
+                if (end_pos > entry.beg) {
+                    entry.end = end_pos;
+                }
+            }
+        }
+        if (checkpointing_) {
+            if (entry.tid != chrom_tid_) {
+                chrom_tid_ = entry.tid;
+                chrom_end_ = 0;
+            }
+            if (n_fields == 8 && strncmp(fields[7], "spVCF_checkpointPOS=", 20) != 0) {
+                checkpoints_.push_back({entry.tid, uint64_t(entry.beg + 1), data_lines_,
+                                        line_block_, line_offset_, chrom_end_});
+            }
+            chrom_end_ = std::max(chrom_end_, uint64_t(entry.end));
+        }
+        ++data_lines_;
+        if (!indexing_) {
+            return;
+        }
+        entry.block = cur_->number;
+        entry.offset = cur_->size;
+        index_pending_.push_back(entry);
+    }
+
+    void index_resolve(const IndexEntry &entry, uint64_t block_address) {
+        uint64_t voffset = block_address | entry.offset;
+        if (entry.tid < 0) {
+            init_index(voffset);
+        } else if (hts_idx_push(idx_, entry.tid, entry.beg, entry.end, voffset, 1) != 0) {
+            throw std::runtime_error("Failed to index output; is it sorted? (at " +
+                                     seqnames_[entry.tid] + ":" + std::to_string(entry.beg + 1) +
+                                     ")");
+        }
+    }
+
+    void init_index(uint64_t offset0) {
+        idx_ = csi_ ? hts_idx_init(0, HTS_FMT_CSI, offset0, 14, 6)
+                    : hts_idx_init(0, HTS_FMT_TBI, offset0, 14, 5);
+        if (!idx_) {
+            throw std::runtime_error("Failed to initialize index");
+        }
+    }
+
+    void save_index() {
+        const uint64_t final_offset = compressed_offset_ << 16;
+        if (!idx_) {
+            // no data lines
+            init_index(final_offset);
+        }
+        if (hts_idx_finish(idx_, final_offset) != 0) {
+            throw std::runtime_error("Failed to finish index");
+        }
+
+        // tabix metadata: configuration & sequence names (little-endian)
+        const tbx_conf_t &conf = tbx_conf_vcf;
+        std::string names;
+        for (const auto &name : seqnames_) {
+            names.append(name.c_str(), name.size() + 1);
+        }
+        std::string meta;
+        for (int32_t x : {conf.preset, conf.sc, conf.bc, conf.ec, conf.meta_char, conf.line_skip,
+                          int32_t(names.size())}) {
+            for (int i = 0; i < 4; i++) {
+                meta += char((uint32_t(x) >> (8 * i)) & 0xff);
+            }
+        }
+        meta += names;
+        const int fmt = csi_ ? HTS_FMT_CSI : HTS_FMT_TBI;
+        if (hts_idx_set_meta(idx_, meta.size(), (uint8_t *)&meta[0], 1) != 0 ||
+            hts_idx_save_as(idx_, filename_.c_str(), nullptr, fmt) != 0) {
+            throw std::runtime_error("Failed to save index");
+        }
+    }
+
+    void save_checkpoints() {
+        struct stat st;
+        if (stat(filename_.c_str(), &st) != 0) {
+            throw std::runtime_error("Failed to save checkpoint index");
+        }
+        FileWriter out(filename_ + ".ckpt", false, nullptr, 1 << 16);
+        out.Write("#spVCF_checkpoints\t" + std::to_string(st.st_size) + "\n");
+        for (const auto &ck : checkpoints_) {
+            uint64_t voffset = (block_addresses_[ck.block] << 16) | ck.offset;
+            out.Write(seqnames_[ck.tid] + "\t" + std::to_string(ck.pos) + "\t" +
+                      std::to_string(voffset) + "\t" + std::to_string(ck.line) + "\t" +
+                      std::to_string(ck.prior_end) + "\n");
+        }
+        out.Close();
+    }
+
+    std::string filename_;
+    int fd_ = -1;
+    bool owned_ = false;
+    char *buf_ = nullptr;
+    size_t capacity_, size_ = 0;
+
+    bool bgzf_ = false;
+    hts_tpool *pool_ = nullptr;
+    hts_tpool_process *q_ = nullptr;
+    size_t max_in_flight_ = 0, in_flight_ = 0;
+    Block *cur_ = nullptr; // block being filled
+    std::vector<Block *> free_blocks_;
+    uint64_t blocks_ = 0, compressed_offset_ = 0;
+
+    bool indexing_ = false, csi_ = false, in_line_ = false, seen_data_ = false;
+    std::string head_;
+    int head_tabs_ = 0;
+    std::vector<IndexEntry> index_pending_; // from index_resolved_ on, yet to be resolved
+    size_t index_resolved_ = 0;
+    std::unordered_map<std::string, int> tids_;
+    std::vector<std::string> seqnames_;
+    hts_idx_t *idx_ = nullptr;
+
+    bool checkpointing_ = false, aligning_ = false;
+    uint64_t line_block_ = 0, data_lines_ = 0;
+    size_t line_offset_ = 0;
+    int chrom_tid_ = -1;     // of the last data line
+    uint64_t chrom_end_ = 0; // greatest END of the data lines so far on chrom_tid_
+    std::vector<CheckpointEntry> checkpoints_;
+    std::vector<uint64_t> block_addresses_; // compressed offset of each block written
+};
+
+} // namespace spVCF
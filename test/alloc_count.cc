@@ -0,0 +1,92 @@
+// Check that the encoder & decoder don't allocate heap memory per line once warmed up, encoding
+// the input pVCF (with squeezing) and then decoding the result. Each runs through the whole input
+// once to warm up, so that its buffers reach their high-water marks for the longest lines, then
+// Restart()s and runs through the data lines again, counting the operator new calls made inside
+// ProcessLine(). Prints the two counts, which should both be zero. This doesn't see DenseCells'
+// arena, which uses malloc/realloc directly. Given column_threads, the encoder processes wide rows
+// in that many stripes.
+// Usage: ./alloc_count in.vcf [checkpoint_period [column_threads]]
+#include "spVCF.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+    ++allocations;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Run each line through tc, appending the output lines to out (if given), then Restart() it and
+// run the data lines through again, returning the number of allocations made by ProcessLine().
+static uint64_t run(spVCF::Transcoder &tc, const vector<string> &lines, vector<string> *out) {
+    vector<char> buf;
+    for (const string &line : lines) {
+        buf.assign(line.begin(), line.end());
+        buf.push_back(0);
+        const char *output = tc.ProcessLine(buf.data());
+        if (out) {
+            out->emplace_back(output, tc.OutputLength());
+        }
+    }
+    tc.Restart();
+    uint64_t total = 0;
+    for (const string &line : lines) {
+        if (line[0] != '#') {
+            buf.assign(line.begin(), line.end());
+            buf.push_back(0);
+            const uint64_t before = allocations;
+            tc.ProcessLine(buf.data());
+            total += allocations - before;
+        }
+    }
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " in.vcf [checkpoint_period [column_threads]]" << endl;
+        return 1;
+    }
+    uint64_t period = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000;
+    size_t column_threads = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1;
+    try {
+        vector<string> vcf;
+        ifstream input(argv[1]);
+        for (string line; getline(input, line);) {
+            if (!line.empty()) {
+                vcf.push_back(move(line));
+            }
+        }
+        if (input.bad() || vcf.empty()) {
+            throw runtime_error("failed to read " + string(argv[1]));
+        }
+
+        vector<string> spvcf;
+        spvcf.reserve(vcf.size());
+        auto encoder = spVCF::NewEncoder(period, true, true, 2.0, column_threads);
+        uint64_t encoder_allocations = run(*encoder, vcf, &spvcf);
+        auto decoder = spVCF::NewDecoder(false);
+        uint64_t decoder_allocations = run(*decoder, spvcf, nullptr);
+        cout << encoder_allocations << ' ' << decoder_allocations << endl;
+    } catch (exception &exn) {
+        cerr << exn.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Print each record of a VCF or BCF file as the hex of its binary encoding, as bcf_write() would
+// write it (e.g. bcftools view -Ob), one per line. VCF text is parsed by htslib's vcf_parse(), so
+// this compares BCF written by spvcf decode -O b with htslib's reading of the decoded VCF,
+// without regard to the header text or the BGZF compression.
+// Usage: ./bcf_records in.vcf|in.bcf
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static void print_hex(const void *data, size_t len, string &out) {
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++) {
+        out += digits[p[i] >> 4];
+        out += digits[p[i] & 0xf];
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " in.vcf|in.bcf" << endl;
+        return 1;
+    }
+    htsFile *fp = hts_open(argv[1], "r");
+    bcf_hdr_t *hdr = fp ? bcf_hdr_read(fp) : nullptr;
+    if (!hdr) {
+        cerr << "Failed to open " << argv[1] << endl;
+        return 1;
+    }
+    bcf1_t *rec = bcf_init();
+    string line;
+    int ret;
+    while ((ret = bcf_read(fp, hdr, rec)) == 0) {
+        // the record's fixed-size fields, laid out as in the BCF file
+        uint32_t x[8];
+        float qual = rec->qual;
+        x[0] = uint32_t(rec->shared.l + 24);
+        x[1] = uint32_t(rec->indiv.l);
+        x[2] = uint32_t(rec->rid);
+        x[3] = uint32_t(rec->pos);
+        x[4] = uint32_t(rec->rlen);
+        memcpy(&x[5], &qual, sizeof(qual));
+        x[6] = uint32_t(rec->n_info) | uint32_t(rec->n_allele) << 16;
+        x[7] = uint32_t(rec->n_sample) | uint32_t(rec->n_fmt) << 24;
+        line.clear();
+        print_hex(x, sizeof(x), line);
+        line += ' ';
+        print_hex(rec->shared.s, rec->shared.l, line);
+        line += ' ';
+        print_hex(rec->indiv.s, rec->indiv.l, line);
+        cout << line << '\n';
+    }
+    bcf_destroy(rec);
+    bcf_hdr_destroy(hdr);
+    if (ret < -1 || hts_close(fp) != 0) {
+        cerr << "Failed to read " << argv[1] << endl;
+        return 1;
+    }
+    return 0;
+}
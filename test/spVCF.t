@@ -10,7 +10,7 @@ D=/tmp/spVCFTests
 rm -rf $D
 mkdir -p $D
 
-plan tests 28
+plan tests 68
 
 pigz -dc "$HERE/data/small.vcf.gz" > $D/small.vcf
 "$EXE" encode --no-squeeze -o $D/small.spvcf $D/small.vcf
@@ -21,6 +21,10 @@ pigz -dc "$HERE/data/small.vcf.gz" | "$EXE" encode -n -q > $D/small.spvcf
 is "$?" "0" "piped I/O"
 is "$(cat $D/small.spvcf | grep -v \#\#fileformat | wc -c)" "37097488" "piped I/O output size"
 
+is "$(head -c -1 $D/small.vcf | "$EXE" encode -n -q | sha256sum)" \
+   "$(cat $D/small.spvcf | sha256sum)" \
+   "input without final newline"
+
 "$EXE" decode -o $D/small.roundtrip.vcf $D/small.spvcf
 is "$?" "0" "decode"
 is "$(cat $D/small.roundtrip.vcf | wc -c)" "54007969" "roundtrip decode"
@@ -55,6 +59,46 @@ is "$(egrep -o "spVCF_checkpointPOS=[0-9]+" $D/small.squeezed.spvcf | uniq | cut
 
 is $(grep -o ":32" "$D/small.squeezed_only.vcf" | wc -l) "140477" "squeezed DP rounding, r=2"
 is $("$EXE" squeeze -q -r 1.618 "$D/small.vcf" | grep -o ":29" | wc -l) "114001" "squeezed DP rounding, r=phi"
+is "$(timeout 60 "$EXE" squeeze -q -r 1.0000001 "$D/small.vcf" | wc -l)" "$(cat $D/small.vcf | wc -l)" \
+   "squeezed DP rounding, r close to 1"
+
+# DP near the top of the 64-bit range: finding each rounding step mustn't scan through integers,
+# and no DP rounds up (or wraps around)
+awk 'BEGIN {
+    srand(1); OFS = "\t"; print "##fileformat=VCFv4.2"
+    printf "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"; for (i = 1; i <= 50; i++) printf "\ts%d", i; print ""
+    for (j = 1; j <= 2000; j++) {
+        printf "chr1\t%d\t.\tA\tG\t.\t.\t.\tGT:AD:DP", j
+        for (i = 1; i <= 50; i++) { dp = int(1 + 9 * rand()); for (d = 0; d < 18; d++) dp = dp int(10 * rand()); printf "\t0/0:%s,0:%s", dp, dp }
+        print ""
+    }
+    printf "chr1\t2001\t.\tA\tG\t.\t.\t.\tGT:AD:DP"; for (i = 1; i <= 50; i++) printf "\t0/0:18446744073709551615,0:18446744073709551615"; print ""
+}' > $D/hugedp.vcf
+is "$(timeout 10 "$EXE" squeeze -q -r 1.0000001 $D/hugedp.vcf | wc -l)" "$(cat $D/hugedp.vcf | wc -l)" \
+   "squeezed DP rounding, huge DP with r close to 1"
+is "$("$EXE" squeeze -q -r 2 $D/hugedp.vcf | tail -n 1 | cut -f 10)" "0/0:9223372036854775808" \
+   "squeezed DP rounding, r=2 at the 64-bit limit"
+
+LC_ALL=C "$EXE" encode -p 0 --checkpoint-bytes 1M -o $D/small.squeezed.budget.spvcf $D/small.vcf \
+    2> $D/small.squeezed.budget.stats
+is "$(LC_ALL=C awk -v B=1048576 '!/^#/ { if ($8 !~ /^spVCF_checkpointPOS=/) { if (before >= B) bad++; n=0 } before=n; n+=length($0)+1 }
+                             END { if (before >= B) bad++; print bad+0 }' $D/small.squeezed.budget.spvcf)" \
+   "0" \
+   "checkpoint byte budget"
+# the reported percentiles (from a histogram) may exceed the exact ones by less than 1/8
+LC_ALL=C awk '!/^#/ { if ($8 !~ /^spVCF_checkpointPOS=/ && n) { print n; n=0 } n+=length($0)+1 } END { print n }' \
+    $D/small.squeezed.budget.spvcf | sort -n \
+    | awk '{ a[NR]=$1 } END { print a[int((NR*50+99)/100)]; print a[int((NR*90+99)/100)]; print a[int((NR*99+99)/100)]; print a[NR] }' \
+    > $D/small.squeezed.budget.intervals
+is "$(grep 'interval bytes (.*th\|interval bytes (max' $D/small.squeezed.budget.stats | awk '{print $NF}' \
+      | paste - $D/small.squeezed.budget.intervals | awk '$1 < $2 || 8 * $1 >= 9 * $2 { bad++ } END { print bad+0 }')" \
+   "0" \
+   "checkpoint interval percentiles"
+"$EXE" encode -q --checkpoint-bytes 20000000000G -o $D/small.squeezed.overflow.spvcf $D/small.vcf
+isnt "$?" "0" "reject overflowing --checkpoint-bytes"
+is "$("$EXE" decode -q $D/small.squeezed.budget.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "checkpoint byte budget roundtrip"
 
 bgzip -c $D/small.squeezed.spvcf > $D/small.squeezed.spvcf.gz
 tabix -p vcf $D/small.squeezed.spvcf.gz
@@ -75,11 +119,67 @@ is "$(cat $D/small.squeezed.slice.vcf | grep -v ^# | sha256sum)" \
    "$(cat $D/small.squeezed.roundtrip.slice.vcf | grep -v ^# | sha256sum)" \
    "slice fidelity"
 
+"$EXE" encode -q -p 500 -@ 2 --index -o $D/small.squeezed.indexed.spvcf.gz $D/small.vcf
+"$EXE" tabix -o $D/small.squeezed.indexed.slice.spvcf $D/small.squeezed.indexed.spvcf.gz chr21:5143000-5226000
+is "$(cat $D/small.squeezed.indexed.slice.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.slice.spvcf | sha256sum)" \
+   "slice using index built while encoding"
+
+"$EXE" encode -q -p 500 --checkpoint-index -o $D/small.squeezed.ckpt.spvcf.gz $D/small.vcf
+tabix -p vcf $D/small.squeezed.ckpt.spvcf.gz
+"$EXE" tabix -o $D/small.squeezed.ckpt.slice.spvcf $D/small.squeezed.ckpt.spvcf.gz chr21:5143000-5226000
+is "$(cat $D/small.squeezed.ckpt.slice.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.slice.spvcf | sha256sum)" \
+   "slice using checkpoint sidecar"
+
+# extend some lines, including checkpoints, past the following checkpoints with INFO END
+awk -F '\t' -v OFS='\t' '!/^#/ && ++n % 37 == 1 { $8 = ($8 == "." ? "" : $8 ";") "END=" ($2 + 20000) } 1' \
+    $D/small.vcf > $D/small.end.vcf
+"$EXE" encode -q -p 10 --index --checkpoint-index -o $D/small.end.spvcf.gz $D/small.end.vcf
+regions="chr21:5143000-5226000 chr21:5030100-5100000 chr21:5250000-5260000 chr21:5200000-5201000"
+"$EXE" tabix -o $D/small.end.ckpt.slices.spvcf $D/small.end.spvcf.gz $regions
+rm $D/small.end.spvcf.gz.ckpt
+is "$("$EXE" tabix $D/small.end.spvcf.gz $regions | sha256sum)" \
+   "$(cat $D/small.end.ckpt.slices.spvcf | sha256sum)" \
+   "slice using checkpoint sidecar, with overlapping END"
+
+"$EXE" encode -q -p 500 --checkpoint-index --align-checkpoints -o $D/small.squeezed.aligned.spvcf.gz $D/small.vcf
+is "$(tail -n +2 $D/small.squeezed.aligned.spvcf.gz.ckpt | awk '$3 % 65536 != 0' | wc -l)" "0" \
+   "checkpoints aligned to BGZF blocks"
+is "$(bgzip -dc $D/small.squeezed.aligned.spvcf.gz | sha256sum)" \
+   "$(cat $D/small.squeezed.spvcf | sha256sum)" \
+   "aligned checkpoints content"
+
+# a narrow file, whose lines have fewer than 20 bytes from INFO to the end
+awk -F '\t' -v OFS='\t' '!/^#/ { $8 = "."; $9 = "GT"; sub(/:.*/, "", $10) } { NF = 10 } 1' \
+    $D/small.vcf > $D/small.narrow.vcf
+"$EXE" encode -q -p 100 --checkpoint-index --align-checkpoints -o $D/small.narrow.spvcf.gz $D/small.narrow.vcf
+is "$(tail -n +2 $D/small.narrow.spvcf.gz.ckpt | awk '$3 % 65536 != 0' | wc -l)" "0" \
+   "narrow checkpoints aligned to BGZF blocks"
+
+regions="chr21:5143000-5226000 chr21:5030000-5100000 chr21:5250000-5260000 chr21:5143000-5226000"
+is "$("$EXE" tabix -t 3 $D/small.squeezed.spvcf.gz $regions | sha256sum)" \
+   "$("$EXE" tabix $D/small.squeezed.spvcf.gz $regions | sha256sum)" \
+   "multithreaded multi-region slice"
+
 "$EXE" tabix -o $D/small.squeezed.slice_chr21.spvcf $D/small.squeezed.spvcf.gz chr21
 is "$(cat $D/small.squeezed.slice_chr21.spvcf | sha256sum)" \
    "$(cat $D/small.squeezed.spvcf | sha256sum)" \
    "chromosome slice"
 
+# fast-forwarding to a region mustn't take time proportional to N: a checkpoint of 10^6 columns,
+# then 20,000 lines of one explicit cell & a quote run, each of which used to rebuild the whole row
+awk -v N=1000000 -v L=20000 'BEGIN {
+    OFS = "\t"; print "##fileformat=spVCFvtest;VCFv4.2"
+    printf "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"; for (i = 1; i <= N; i++) printf "\ts%d", i; print ""
+    printf "chr1\t1\t.\tA\tG\t.\t.\t.\tGT"; for (i = 1; i <= N; i++) printf "\t0/0"; print ""
+    for (j = 2; j <= L; j++) print "chr1", j, ".", "A", "G", ".", ".", "spVCF_checkpointPOS=1", "GT", "0/1\t\"" (N - 1)
+}' | bgzip -c > $D/wide_runs.spvcf.gz
+tabix -p vcf $D/wide_runs.spvcf.gz
+is "$(timeout 10 "$EXE" tabix $D/wide_runs.spvcf.gz chr1:20000-20000 | grep -v '^#' | cut -f 2,10,11 | tr '\t' ' ')" \
+   "20000 0/1 0/0" \
+   "slice fast-forwarding over wide quote runs"
+
 pigz -dc "$HERE/data/small.vcf.gz" | "$EXE" encode -n -t $(nproc) - > $D/small.mt.spvcf
 is "$?" "0" "multithreaded encode"
 is "$(cat $D/small.mt.spvcf | grep -v \#\#fileformat | wc -c)" "37097488" "multithreaded output size"
@@ -91,11 +191,133 @@ is "$(cat $D/small.vcf | grep -v ^# | sha256sum)" \
    "$(cat $D/small.mt.roundtrip.vcf | grep -v ^# | sha256sum)" \
    "multithreaded roundtrip fidelity"
 
+is "$("$EXE" decode -q -t 3 $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "multithreaded decode"
+
+head -n 1000 $D/small.squeezed.roundtrip.vcf | grep -m 1 ^#CHROM | cut -f 10,12,500 | tr '\t' '\n' > $D/samples.txt
+is "$("$EXE" decode -q -s $D/samples.txt $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cut -f 1-10,12,500 $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "decode samples"
+is "$("$EXE" decode -q -t 3 -s $D/samples.txt $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cut -f 1-10,12,500 $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "multithreaded decode samples"
+
+"$EXE" decode -q --with-missing-fields -o $D/small.squeezed.padded.vcf $D/small.squeezed.spvcf
+is "$(grep -v ^# $D/small.squeezed.padded.vcf | \
+      awk '{n=split($5,a,",")+1; iad=0; k=split($9,f,":"); for(j=1;j<=k;j++) if(f[j]=="AD") iad=j; if(!iad) next;
+            for(i=10;i<=NF;i++){split($i,c,":"); if(split(c[iad],ad,",")!=n) bad++}} END {print bad+0}')" \
+   "0" \
+   "--with-missing-fields AD lengths at multiallelic sites"
+is "$("$EXE" decode -q -t 3 --with-missing-fields $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.padded.vcf | sha256sum)" \
+   "multithreaded decode --with-missing-fields"
+
+HTSFILE="$HERE/../external/src/htslib/htsfile"
+"$EXE" decode -q -O b -o $D/small.squeezed.bcf $D/small.squeezed.spvcf
+is "$("$HTSFILE" -c $D/small.squeezed.bcf | grep -v ^# | sha256sum)" \
+   "$("$HTSFILE" -c $D/small.squeezed.roundtrip.vcf 2> /dev/null | grep -v ^# | sha256sum)" \
+   "decode to BCF"
+is "$("$HERE/../bcf_records" $D/small.squeezed.bcf | sha256sum)" \
+   "$("$HERE/../bcf_records" $D/small.squeezed.roundtrip.vcf 2> /dev/null | sha256sum)" \
+   "decode to BCF records as htslib parses them from VCF"
+
+is "$("$EXE" encode -q -p 500 $D/small.squeezed.bcf | grep -v ^# | sha256sum)" \
+   "$(cat $D/small.squeezed.spvcf | grep -v ^# | sha256sum)" \
+   "encode from BCF"
+
+is "$("$HERE/../libspvcf_roundtrip" $D/small.squeezed.spvcf 500 | sha256sum)" \
+   "$(cat $D/small.squeezed.spvcf | sha256sum)" \
+   "libspvcf SparseReader & RowEncoder roundtrip"
+
+is "$("$HERE/../alloc_count" $D/small.vcf 500)" "0 0" \
+   "no allocations per line in steady-state encode & decode"
+
+# replicate the samples to widen the rows enough for several column stripes
+head -n $(( $(grep -c '^#' $D/small.vcf) + 200 )) $D/small.vcf \
+    | awk -F '\t' '/^##/ { print; next } { printf "%s", $0; for (r = 1; r < 30; r++) for (i = 10; i <= NF; i++) printf "\t%s", ($1 == "#CHROM" ? $i "_" r : $i); print "" }' \
+    > $D/small.wide.vcf
+is "$("$EXE" encode -q -p 100 --column-threads 3 $D/small.wide.vcf | sha256sum)" \
+   "$("$EXE" encode -q -p 100 $D/small.wide.vcf | sha256sum)" \
+   "column-threaded encode identical to single-threaded"
+is "$("$HERE/../alloc_count" $D/small.wide.vcf 100 3)" "0 0" \
+   "no allocations per line in steady-state column-threaded encode"
+
+"$EXE" subset -q -s $D/samples.txt -o $D/small.squeezed.subset.spvcf $D/small.squeezed.spvcf
+is "$("$EXE" decode -q $D/small.squeezed.subset.spvcf | sha256sum)" \
+   "$(cut -f 1-10,12,500 $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "subset"
+is "$("$EXE" subset -q -t 3 -s $D/samples.txt $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cat $D/small.squeezed.subset.spvcf | sha256sum)" \
+   "multithreaded subset"
+
+# a row implying the wrong number of columns, after the last selected one
+head -n 2 $D/samples.txt > $D/samples2.txt
+awk -F '\t' -v OFS='\t' '!/^#/ && ++n == 2 { $0 = $0 "\t\"" } 1' $D/small.squeezed.spvcf \
+    | "$EXE" subset -q -s $D/samples2.txt > /dev/null 2>&1
+isnt "$?" "0" "subset of row with too many columns"
+awk -F '\t' -v OFS='\t' '!/^#/ && ++n == 2 { NF-- } 1' $D/small.squeezed.spvcf \
+    | "$EXE" subset -q -s $D/samples2.txt > /dev/null 2>&1
+isnt "$?" "0" "subset of row with too few columns"
+
+"$EXE" sitestats -q -o $D/small.sitestats.vcf $D/small.squeezed.spvcf
+is "$(grep -v ^# $D/small.sitestats.vcf | grep -o ";AN=[0-9]*" | sha256sum)" \
+   "$(grep -v ^# $D/small.squeezed.roundtrip.vcf | \
+      awk '{an=0; for(i=10;i<=NF;i++){split($i,c,":"); n=split(c[1],a,/[\/|]/); for(j=1;j<=n;j++) if(a[j]!=".") an++} print ";AN=" an}' | \
+      sha256sum)" \
+   "sitestats AN"
+is "$("$EXE" sitestats -q -t 3 $D/small.squeezed.spvcf | sha256sum)" \
+   "$(cat $D/small.sitestats.vcf | sha256sum)" \
+   "multithreaded sitestats"
+
+"$EXE" samplestats -o $D/small.samplestats.tsv $D/small.squeezed.spvcf
+is "$(cat $D/small.samplestats.tsv | sha256sum)" \
+   "$(awk -F '\t' -v OFS='\t' '
+        function report(   i) {
+            for (i = 10; i <= nf; i++)
+                print chrom, name[i], n, m[i] + 0, h[i] + 0, r[i] + 0, (d[i] ? sprintf("%.2f", s[i] / d[i]) : ".")
+            split("", m); split("", h); split("", r); split("", d); split("", s); n = 0
+        }
+        /^##/ { next }
+        /^#CHROM/ { nf = NF; for (i = 10; i <= NF; i++) name[i] = $i; print "#CHROM", "SAMPLE", "SITES", "MISSING", "HET", "NONREF", "MEAN_DP"; next }
+        $1 != chrom { if (n) report(); chrom = $1 }
+        {
+            n++; idp = 0; k = split($9, f, ":")
+            for (j = k; j > 1; j--) if (f[j] == "DP") idp = j
+            for (i = 10; i <= NF; i++) {
+                split($i, c, ":"); g = split(c[1], a, /[\/|]/); miss = het = nonref = 0
+                for (j = 1; j <= g; j++) { if (a[j] == ".") miss = 1; else if (a[j] + 0 > 0) nonref = 1; if (a[j] != a[1]) het = 1 }
+                m[i] += miss; h[i] += het && !miss; r[i] += nonref
+                if (idp && c[idp] ~ /^[0-9]/) { d[i]++; s[i] += c[idp] }
+            }
+        }
+        END { if (n) report() }' $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "samplestats"
+is "$("$EXE" samplestats -t 2 $D/small.squeezed.spvcf.gz | sha256sum)" \
+   "$(cat $D/small.samplestats.tsv | sha256sum)" \
+   "multithreaded samplestats"
+
 is "$(egrep -o "spVCF_checkpointPOS=[0-9]+" $D/small.mt.spvcf | uniq | cut -f2 -d = | tr '\n' ' ')" \
    "5030088 5142698 5232868 5252604 5273770 " \
    "multithreaded checkpoint positions"
 
+is "$("$EXE" encode -q -p 500 -t 3 $D/small.vcf | sha256sum)" \
+   "$(cat $D/small.squeezed.spvcf | sha256sum)" \
+   "multithreaded encode identical to single-threaded"
+
 is $("$EXE" encode -r 1.618 -t $(nproc) $D/small.vcf | "$EXE" decode | grep -o ":29" | wc -l) "114001" \
    "multithreaded encode DP rounding, r=phi"
 
+"$EXE" encode -q -p 500 -@ 2 -o $D/small.squeezed.direct.spvcf.gz "$HERE/data/small.vcf.gz"
+is "$(bgzip -dc $D/small.squeezed.direct.spvcf.gz | sha256sum)" \
+   "$(cat $D/small.squeezed.spvcf | sha256sum)" \
+   "bgzip input & output"
+
+is "$("$EXE" decode -q -@ 2 $D/small.squeezed.direct.spvcf.gz | sha256sum)" \
+   "$(cat $D/small.squeezed.roundtrip.vcf | sha256sum)" \
+   "decode bgzip input"
+
+"$EXE" encode -q -o /dev/full $D/small.vcf 2> /dev/null
+isnt "$?" "0" "output write error"
+
 rm -rf $D
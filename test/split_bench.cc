@@ -0,0 +1,107 @@
+// Micro-benchmark of spVCF::split() against the former strsep-based implementation, on a
+// synthetic pVCF row. Build with `make split_bench` and run ./split_bench [N] [reps]
+#include "split.h"
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// the former implementation, for reference
+template <typename Out>
+size_t strsep_split(char *s, char delim, Out result, uint64_t maxsplit = ULLONG_MAX) {
+    string delims("\n");
+    delims[0] = delim;
+    char *cursor = s;
+    char *token = strsep(&cursor, delims.c_str());
+    char *last_token = token;
+    uint64_t i = 0;
+    while (token) {
+        *(result++) = last_token = token;
+        if (++i < maxsplit) {
+            token = strsep(&cursor, delims.c_str());
+        } else {
+            if (cursor) {
+                *result = last_token = cursor;
+            }
+            break;
+        }
+    }
+    return last_token ? (last_token + strlen(last_token) - s) : 0;
+}
+
+string synthetic_row(uint64_t N) {
+    string row = "chr21\t5030088\t.\tC\tT\t50\tPASS\tAC=1\tGT:AD:DP:GQ:PL";
+    srand(42);
+    for (uint64_t i = 0; i < N; i++) {
+        int dp = rand() % 40;
+        if (rand() % 10) {
+            row += "\t0/0:" + to_string(dp) + ",0:" + to_string(dp) + ":" + to_string(rand() % 99) +
+                   ":0," + to_string(rand() % 300) + "," + to_string(rand() % 900);
+        } else {
+            row += "\t./.:.:0";
+        }
+    }
+    return row;
+}
+
+// split the row on tabs, then each cell on colons; return token count
+template <typename Split> size_t tokenize(string &row, Split split_fn) {
+    vector<char *> tokens, fields;
+    split_fn(&row[0], '\t', back_inserter(tokens), ULLONG_MAX);
+    size_t ans = tokens.size();
+    for (size_t i = 9; i < tokens.size(); i++) {
+        fields.clear();
+        split_fn(tokens[i], ':', back_inserter(fields), ULLONG_MAX);
+        ans += fields.size();
+    }
+    return ans;
+}
+
+template <typename Split>
+void bench(const char *name, const string &row, size_t reps, Split split_fn) {
+    size_t tokens = 0;
+    double secs = 0;
+    for (size_t r = 0; r < reps; r++) {
+        string copy = row;
+        auto t0 = chrono::steady_clock::now();
+        tokens += tokenize(copy, split_fn);
+        secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    }
+    cout << name << ": " << (double(row.size()) * reps / secs / 1e9) << " GB/s (" << tokens / reps
+         << " tokens/row)" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t N = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t reps = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10;
+    string row = synthetic_row(N);
+
+    // check the implementations agree, including with maxsplit
+    for (uint64_t maxsplit : {uint64_t(ULLONG_MAX), uint64_t(9), uint64_t(1)}) {
+        string row1 = row, row2 = row;
+        vector<char *> tokens1, tokens2;
+        size_t len1 = strsep_split(&row1[0], '\t', back_inserter(tokens1), maxsplit);
+        size_t len2 = spVCF::split(&row2[0], '\t', back_inserter(tokens2), maxsplit);
+        if (len1 != len2 || tokens1.size() != tokens2.size()) {
+            throw runtime_error("split() mismatch");
+        }
+        for (size_t i = 0; i < tokens1.size(); i++) {
+            if (tokens1[i] - &row1[0] != tokens2[i] - &row2[0] || strcmp(tokens1[i], tokens2[i])) {
+                throw runtime_error("split() token mismatch");
+            }
+        }
+    }
+
+    cout << "N = " << N << ", row = " << row.size() << " bytes" << endl;
+    bench("strsep split()", row, reps, [](char *s, char d, back_insert_iterator<vector<char *>> o,
+                                          uint64_t m) { return strsep_split(s, d, o, m); });
+    bench("spVCF::split()", row, reps, [](char *s, char d, back_insert_iterator<vector<char *>> o,
+                                          uint64_t m) { return spVCF::split(s, d, o, m); });
+    return 0;
+}